@@ -0,0 +1,418 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json_util.hpp"
+#include "metrics.hpp"
+#include "wav_file.hpp"
+
+// Cross-client batching in front of the ASR backend.
+//
+// Connections submit audio chunks; the scheduler thread groups them into
+// batches of up to maxBatch items, waiting at most maxWait after the oldest
+// item arrived, and hands each batch to an AsrWorker. Results carry the
+// session id they came from so the server can route them back.
+
+struct AsrRequest {
+    uint64_t id = 0;            // Unique per server, echoed in the result
+    uint64_t session = 0;       // Server-side connection id
+    int channel = -1;           // Capture channel, -1 for mixed/mono
+    std::string audio;          // WAV image or raw PCM16
+    std::chrono::steady_clock::time_point enqueued;
+};
+
+struct AsrResult {
+    uint64_t id = 0;
+    uint64_t session = 0;
+    bool ok = false;
+    std::string json;           // Client-facing JSON object
+};
+
+class AsrWorker {
+public:
+    virtual ~AsrWorker() = default;
+
+    // One result per request, in the same order
+    virtual std::vector<AsrResult> process(const std::vector<AsrRequest>& batch) = 0;
+    virtual std::string name() const = 0;
+};
+
+// Default worker: stores each chunk under output_test/ like the server always
+// has, and reports the file name
+class FileWorker : public AsrWorker {
+public:
+    explicit FileWorker(std::string dir = "output_test", WavFormat rawFormat = WavFormat())
+        : dir(std::move(dir)), rawFormat(rawFormat) {
+        std::filesystem::create_directories(this->dir);
+    }
+
+    std::vector<AsrResult> process(const std::vector<AsrRequest>& batch) override {
+        std::vector<AsrResult> results;
+        results.reserve(batch.size());
+        for (const AsrRequest& req : batch) {
+            AsrResult result{req.id, req.session, false, ""};
+            const std::string filename = makeFilename(req);
+            try {
+                WavView wav;
+                if (wav.parse(req.audio.data(), req.audio.size())) {
+                    // Already a WAV image: store it verbatim
+                    std::ofstream file(filename, std::ios::binary);
+                    if (!file) throw std::runtime_error("Failed to open output file");
+                    file.write(req.audio.data(), req.audio.size());
+                } else {
+                    // Raw PCM16 upload: wrap it in a header
+                    WavWriter writer(filename, rawFormat);
+                    writer.write(req.audio.data(), req.audio.size());
+                    writer.close();
+                }
+                result.ok = true;
+                result.json = "{\"type\":\"saved\",\"id\":" + std::to_string(req.id) +
+                              ",\"file\":\"" + json::escape(filename) + "\",\"bytes\":" +
+                              std::to_string(req.audio.size()) + "}";
+            } catch (const std::exception& e) {
+                result.json = "{\"type\":\"asr_error\",\"id\":" + std::to_string(req.id) +
+                              ",\"error\":\"" + json::escape(e.what()) + "\"}";
+            }
+            results.push_back(std::move(result));
+        }
+        return results;
+    }
+
+    std::string name() const override { return "file:" + dir; }
+
+private:
+    std::string makeFilename(const AsrRequest& req) const {
+        auto now = std::chrono::system_clock::now();
+        auto time = std::chrono::system_clock::to_time_t(now);
+        std::tm tm;
+        localtime_r(&time, &tm);
+
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+        std::string name = dir + "/rec_" + stamp + "_s" + std::to_string(req.session);
+        if (req.channel >= 0) name += "_ch" + std::to_string(req.channel);
+        return name + "_" + std::to_string(req.id) + ".wav";
+    }
+
+    std::string dir;
+    WavFormat rawFormat;
+};
+
+// Runs a local process (through /bin/sh) and talks to it over its stdin and
+// stdout. Per batch it writes
+//
+//   batch <n>\n
+//   <id> <session> <channel> <bytes>\n<audio bytes>      (n times)
+//
+// and reads back n lines, each one JSON object for the matching item. A
+// worker that exits or misbehaves fails the batch and is restarted on the
+// next one. So does one that has not answered the whole batch within
+// `timeout` (0 waits forever): it is killed rather than left to stall the
+// scheduler.
+class PipeWorker : public AsrWorker {
+public:
+    explicit PipeWorker(std::string command, std::chrono::milliseconds timeout = std::chrono::milliseconds(10000))
+        : command(std::move(command)), timeout(timeout) {
+        // A dead worker must not take the server down with it
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~PipeWorker() override { stop(); }
+
+    PipeWorker(const PipeWorker&) = delete;
+    PipeWorker& operator=(const PipeWorker&) = delete;
+
+    std::vector<AsrResult> process(const std::vector<AsrRequest>& batch) override {
+        if (pid <= 0 && !start()) {
+            return failAll(batch, "worker failed to start");
+        }
+        deadline = std::chrono::steady_clock::now() + timeout;
+        timedOut = false;
+
+        std::string header = "batch " + std::to_string(batch.size()) + "\n";
+        bool ok = writeAll(header.data(), header.size());
+        for (size_t i = 0; ok && i < batch.size(); ++i) {
+            const AsrRequest& req = batch[i];
+            header = std::to_string(req.id) + " " + std::to_string(req.session) + " " +
+                     std::to_string(req.channel) + " " + std::to_string(req.audio.size()) + "\n";
+            ok = writeAll(header.data(), header.size()) && writeAll(req.audio.data(), req.audio.size());
+        }
+
+        std::vector<AsrResult> results;
+        results.reserve(batch.size());
+        std::string line;
+        for (size_t i = 0; ok && i < batch.size(); ++i) {
+            ok = readLine(line);
+            if (ok) {
+                results.push_back({batch[i].id, batch[i].session, true, line});
+            }
+        }
+
+        if (!ok && timedOut) {
+            Metrics::instance().add("asr.worker_timeouts");
+            stop(SIGKILL);
+            return failAll(batch, "worker timed out");
+        }
+        if (!ok) {
+            Metrics::instance().add("asr.worker_failures");
+            stop();
+            return failAll(batch, "worker pipe closed");
+        }
+        return results;
+    }
+
+    std::string name() const override { return "pipe:" + command; }
+
+private:
+    bool start() {
+        int toChild[2];
+        int fromChild[2];
+        if (pipe2(toChild, O_CLOEXEC) != 0) return false;
+        if (pipe2(fromChild, O_CLOEXEC) != 0) {
+            close(toChild[0]);
+            close(toChild[1]);
+            return false;
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            dup2(toChild[0], STDIN_FILENO);
+            dup2(fromChild[1], STDOUT_FILENO);
+            execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+
+        close(toChild[0]);
+        close(fromChild[1]);
+        if (pid < 0) {
+            close(toChild[1]);
+            close(fromChild[0]);
+            return false;
+        }
+        inFd = toChild[1];
+        outFd = fromChild[0];
+        // Non-blocking so a full pipe or a silent worker only ever waits in poll()
+        fcntl(inFd, F_SETFL, fcntl(inFd, F_GETFL) | O_NONBLOCK);
+        fcntl(outFd, F_SETFL, fcntl(outFd, F_GETFL) | O_NONBLOCK);
+        readBuffer.clear();
+        Metrics::instance().add("asr.worker_starts");
+        return true;
+    }
+
+    // A worker that ignores `sig` gets SIGKILL after a second, so neither
+    // the scheduler nor the destructor can hang here
+    void stop(int sig = SIGTERM) {
+        if (inFd >= 0) close(inFd);
+        if (outFd >= 0) close(outFd);
+        inFd = outFd = -1;
+        if (pid > 0) {
+            kill(pid, sig);
+            const auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (waitpid(pid, nullptr, WNOHANG) == 0) {
+                if (std::chrono::steady_clock::now() >= giveUp) {
+                    kill(pid, SIGKILL);
+                    waitpid(pid, nullptr, 0);
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        pid = -1;
+    }
+
+    // Waits for `events` on fd until the batch deadline; false on timeout
+    // or error
+    bool waitFor(int fd, short events) {
+        for (;;) {
+            int waitMs = -1;
+            if (timeout.count() > 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now());
+                if (left.count() <= 0) {
+                    timedOut = true;
+                    return false;
+                }
+                waitMs = static_cast<int>(left.count());
+            }
+            pollfd pfd{fd, events, 0};
+            int r = poll(&pfd, 1, waitMs);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return false;
+            if (r > 0) return true;     // Readiness or hangup; the read/write tells which
+        }
+    }
+
+    bool writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = write(inFd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) {
+                if (!waitFor(inFd, POLLOUT)) return false;
+                continue;
+            }
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool readLine(std::string& line) {
+        for (;;) {
+            size_t nl = readBuffer.find('\n');
+            if (nl != std::string::npos) {
+                line.assign(readBuffer, 0, nl);
+                readBuffer.erase(0, nl + 1);
+                return true;
+            }
+            char chunk[4096];
+            ssize_t n = read(outFd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) {
+                if (!waitFor(outFd, POLLIN)) return false;
+                continue;
+            }
+            if (n <= 0) return false;
+            readBuffer.append(chunk, static_cast<size_t>(n));
+        }
+    }
+
+    static std::vector<AsrResult> failAll(const std::vector<AsrRequest>& batch, const std::string& error) {
+        std::vector<AsrResult> results;
+        results.reserve(batch.size());
+        for (const AsrRequest& req : batch) {
+            results.push_back({req.id, req.session, false,
+                               "{\"type\":\"asr_error\",\"id\":" + std::to_string(req.id) +
+                               ",\"error\":\"" + json::escape(error) + "\"}"});
+        }
+        return results;
+    }
+
+    std::string command;
+    std::chrono::milliseconds timeout;
+    std::chrono::steady_clock::time_point deadline;
+    bool timedOut = false;
+    pid_t pid = -1;
+    int inFd = -1;
+    int outFd = -1;
+    std::string readBuffer;
+};
+
+class BatchScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using ResultHandler = std::function<void(std::vector<AsrResult>)>;
+
+    struct Config {
+        size_t maxBatch = 8;                        // Items per worker call
+        std::chrono::milliseconds maxWait{50};      // Oldest item's longest wait
+        size_t maxQueue = 256;                      // Beyond this, submit() refuses
+    };
+
+    // The handler runs on the scheduler thread; post to the io thread from it
+    BatchScheduler(const Config& cfg, std::unique_ptr<AsrWorker> worker, ResultHandler handler)
+        : config(cfg), worker(std::move(worker)), handler(std::move(handler)) {
+        if (config.maxBatch == 0) config.maxBatch = 1;
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~BatchScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) thread.join();
+    }
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // False when the queue is full; the caller decides what to tell the client
+    bool submit(AsrRequest req) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.size() >= config.maxQueue) {
+                Metrics::instance().add("asr.rejected");
+                return false;
+            }
+            req.enqueued = Clock::now();
+            queue.push_back(std::move(req));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    const AsrWorker& getWorker() const { return *worker; }
+    const Config& getConfig() const { return config; }
+
+private:
+    void run() {
+        std::vector<AsrRequest> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) break;  // stopping with nothing left
+
+            // Hold the batch open until it is full or the oldest item is due
+            const auto deadline = queue.front().enqueued + config.maxWait;
+            cv.wait_until(lock, deadline, [this]() {
+                return stopping || queue.size() >= config.maxBatch;
+            });
+
+            const size_t n = std::min(config.maxBatch, queue.size());
+            batch.clear();
+            for (size_t i = 0; i < n; ++i) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+
+            const auto start = Clock::now();
+            std::vector<AsrResult> results = worker->process(batch);
+            const auto end = Clock::now();
+
+            Metrics& m = Metrics::instance();
+            m.add("asr.batches");
+            m.add("asr.items", static_cast<double>(n));
+            m.set("asr.batch_size", static_cast<double>(n));
+            m.set("asr.wait_ms", std::chrono::duration<double, std::milli>(start - batch.front().enqueued).count());
+            m.set("asr.process_ms", std::chrono::duration<double, std::milli>(end - start).count());
+
+            handler(std::move(results));
+            lock.lock();
+        }
+    }
+
+    Config config;
+    std::unique_ptr<AsrWorker> worker;
+    ResultHandler handler;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<AsrRequest> queue;
+    bool stopping = false;
+    std::thread thread;
+};
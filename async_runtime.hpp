@@ -0,0 +1,191 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/streambuf.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+#include "realtime.hpp"
+
+// Event loop shared by a client's websocket, timers and device pipes.
+//
+// One io_context is run by a small fixed set of threads (ASYNC_THREADS,
+// default 2, the caller of run() included). The websocket transport
+// (websocketpp initialised with this io_context), the arecord pipes and the
+// reconnect and clock timers all complete on it. So waiting costs neither a
+// thread per stage nor a sleep loop. The client loops are written as
+// stackless Asio coroutines that yield at each wait.
+//
+// Everything that touches a client's own state runs on one strand():
+// coroutine steps, timers, pipe reads, and the websocketpp callbacks, which
+// the clients repost onto it. So none of it needs locks. The other threads
+// only carry websocketpp's transport work (TLS and socket I/O) and the
+// stderr readers.
+class AsyncRuntime {
+public:
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    explicit AsyncRuntime(size_t threads = threadsFromEnv())
+        : work(boost::asio::make_work_guard(ioc)), appStrand(boost::asio::make_strand(ioc)),
+          signals(ioc, SIGINT, SIGTERM) {
+        signals.async_wait([this](const boost::system::error_code& ec, int) {
+            if (!ec) stop();
+        });
+        for (size_t i = 1; i < threads; ++i) {
+            workers.emplace_back([this]() { runLoop(); });
+        }
+    }
+
+    ~AsyncRuntime() {
+        stop();
+        join();
+    }
+
+    AsyncRuntime(const AsyncRuntime&) = delete;
+    AsyncRuntime& operator=(const AsyncRuntime&) = delete;
+
+    boost::asio::io_context& context() { return ioc; }
+    const Strand& strand() const { return appStrand; }
+
+    // Runs the loop on the calling thread too; returns after stop() (or
+    // SIGINT/SIGTERM) once the other threads have finished
+    void run() {
+        runLoop();
+        join();
+    }
+
+    void stop() {
+        work.reset();
+        ioc.stop();
+    }
+
+    static size_t threadsFromEnv() {
+        const char* v = std::getenv("ASYNC_THREADS");
+        return v ? static_cast<size_t>(std::max(1, std::atoi(v))) : 2;
+    }
+
+private:
+    void runLoop() {
+        while (true) {
+            try {
+                ioc.run();
+                return;
+            } catch (const std::exception& e) {
+                // A handler threw; the rest of the loop carries on
+                std::cerr << "Event loop error: " << e.what() << std::endl;
+                Metrics::instance().add("async.handler_errors");
+            }
+        }
+    }
+
+    void join() {
+        for (std::thread& t : workers) {
+            if (t.joinable() && t.get_id() != std::this_thread::get_id()) t.join();
+        }
+    }
+
+    boost::asio::io_context ioc;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    Strand appStrand;
+    boost::asio::signal_set signals;
+    std::vector<std::thread> workers;
+};
+
+// A completion a coroutine is waiting on that another callback delivers,
+// e.g. a websocket open/fail handler ending a connect attempt. It completes
+// at most once per arm(), with timed_out if nothing arrives within the
+// timeout, and the handler always runs on `executor`.
+class CompletionSlot {
+public:
+    using Handler = std::function<void(boost::system::error_code)>;
+
+    explicit CompletionSlot(const boost::asio::any_io_executor& executor) : timer(executor) {}
+
+    // A zero timeout waits indefinitely
+    void arm(Handler handler, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = std::move(handler);
+        timer.cancel();
+        if (timeout.count() > 0) {
+            timer.expires_after(timeout);
+            timer.async_wait([this](const boost::system::error_code& ec) {
+                if (!ec) complete(boost::asio::error::timed_out);
+            });
+        }
+    }
+
+    // No-op when nothing is waiting
+    void complete(boost::system::error_code ec = {}) {
+        Handler handler;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending) return;
+            handler.swap(pending);
+            timer.cancel();
+        }
+        boost::asio::post(timer.get_executor(), [handler, ec]() { handler(ec); });
+    }
+
+private:
+    std::mutex mutex;
+    boost::asio::steady_timer timer;
+    Handler pending;
+};
+
+// rt::drainStderr on the loop: forwards a device process's stderr line by
+// line and counts xruns under `metric` without a thread per process. Takes
+// ownership of the fd; the reader goes away at EOF.
+inline void watchStderr(boost::asio::io_context& ioc, int fd, std::string metric) {
+    struct Reader : std::enable_shared_from_this<Reader> {
+        Reader(boost::asio::io_context& ioc, int fd, std::string metric)
+            : pipe(ioc, fd), metric(std::move(metric)) {}
+
+        void next() {
+            auto self = shared_from_this();
+            boost::asio::async_read_until(pipe, buffer, '\n',
+                [self](const boost::system::error_code& ec, size_t) {
+                    std::istream in(&self->buffer);
+                    std::string line;
+                    if (!ec) {
+                        std::getline(in, line);
+                        self->report(line);
+                        self->next();
+                    } else if (self->buffer.size() > 0 && std::getline(in, line)) {
+                        // EOF: whatever followed the last newline
+                        self->report(line);
+                    }
+                });
+        }
+
+        void report(const std::string& line) {
+            std::cerr << line << "\n";
+            if (rt::isXrunLine(line)) Metrics::instance().add(metric);
+        }
+
+        boost::asio::posix::stream_descriptor pipe;
+        boost::asio::streambuf buffer;
+        std::string metric;
+    };
+    std::make_shared<Reader>(ioc, fd, std::move(metric))->next();
+}
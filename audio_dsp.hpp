@@ -0,0 +1,343 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Small set of vectorized kernels shared by the audio processing stages.
+// Each kernel has an SSE2 / NEON path and a scalar tail that also serves as
+// the fallback on other targets.
+namespace dsp {
+
+inline float dotProduct(const float* a, const float* b, size_t n) {
+    size_t i = 0;
+    float sum = 0.0f;
+#if defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) +
+          vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// y += a * x
+inline void axpy(float a, const float* x, float* y, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 va = _mm_set1_ps(a);
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t va = vdupq_n_f32(a);
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), va, vld1q_f32(x + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+inline void int16ToFloat(const int16_t* in, float* out, size_t n) {
+    constexpr float scale = 1.0f / 32768.0f;
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = static_cast<float>(in[i]) * scale;
+    }
+}
+
+// Converts back to PCM16, saturating instead of wrapping on overflow.
+inline void floatToInt16(const float* in, int16_t* out, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), scale));
+        __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    // Rounded to nearest like the other paths; vcvtq_s32_f32 alone truncates
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+#if defined(__aarch64__)
+    auto toInt = [](float32x4_t v) { return vcvtnq_s32_f32(v); };
+#else
+    auto toInt = [](float32x4_t v) {
+        // No round-to-nearest conversion on ARMv7: add 0.5 with v's sign, then truncate
+        const uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(v), vdupq_n_u32(0x80000000u));
+        const float32x4_t half = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vdupq_n_f32(0.5f)), sign));
+        return vcvtq_s32_f32(vaddq_f32(v, half));
+    };
+#endif
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t lo = toInt(vmulq_f32(vld1q_f32(in + i), scale));
+        int32x4_t hi = toInt(vmulq_f32(vld1q_f32(in + i + 4), scale));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#endif
+    for (; i < n; ++i) {
+        float v = std::nearbyint(in[i] * 32768.0f);
+        out[i] = static_cast<int16_t>(std::clamp(v, -32768.0f, 32767.0f));
+    }
+}
+
+// x *= gain
+inline void scale(float* x, float gain, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vg = _mm_set1_ps(gain);
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), vg));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t vg = vdupq_n_f32(gain);
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), vg));
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] *= gain;
+    }
+}
+
+// Largest |x| in PCM16 samples (32768 for -32768)
+inline int32_t peakAbs(const int16_t* x, size_t n) {
+    size_t i = 0;
+    int32_t peak = 0;
+#if defined(__SSE2__)
+    // |x| via saturating negate: -32768 reads as 32767
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+        acc = _mm_max_epi16(acc, _mm_max_epi16(v, _mm_subs_epi16(zero, v)));
+    }
+    int16_t lanes[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    for (int16_t l : lanes) peak = std::max<int32_t>(peak, l);
+#elif defined(__ARM_NEON)
+    int16x8_t acc = vdupq_n_s16(0);
+    for (; i + 8 <= n; i += 8) {
+        acc = vmaxq_s16(acc, vqabsq_s16(vld1q_s16(x + i)));
+    }
+    int16_t lanes[8];
+    vst1q_s16(lanes, acc);
+    for (int16_t l : lanes) peak = std::max<int32_t>(peak, l);
+#endif
+    for (; i < n; ++i) {
+        peak = std::max(peak, std::abs(static_cast<int32_t>(x[i])));
+    }
+    return peak;
+}
+
+// Index of the first sample with |x| > threshold, or n if there is none
+inline size_t firstAbove(const int16_t* x, size_t n, int16_t threshold) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vt = _mm_set1_epi16(threshold);
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+        __m128i a = _mm_max_epi16(v, _mm_subs_epi16(zero, v));
+        if (_mm_movemask_epi8(_mm_cmpgt_epi16(a, vt))) break;
+    }
+#elif defined(__ARM_NEON)
+    const int16x8_t vt = vdupq_n_s16(threshold);
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t above = vcgtq_s16(vqabsq_s16(vld1q_s16(x + i)), vt);
+        uint64x2_t wide = vreinterpretq_u64_u16(above);
+        if (vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) break;
+    }
+#endif
+    // Finish inside the block that matched, or the tail
+    for (; i < n; ++i) {
+        if (std::abs(static_cast<int32_t>(x[i])) > threshold) return i;
+    }
+    return n;
+}
+
+// Index one past the last sample with |x| > threshold, or 0 if there is none
+inline size_t lastAbove(const int16_t* x, size_t n, int16_t threshold) {
+    size_t end = n;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vt = _mm_set1_epi16(threshold);
+    while (end >= 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + end - 8));
+        __m128i a = _mm_max_epi16(v, _mm_subs_epi16(zero, v));
+        if (_mm_movemask_epi8(_mm_cmpgt_epi16(a, vt))) break;
+        end -= 8;
+    }
+#elif defined(__ARM_NEON)
+    const int16x8_t vt = vdupq_n_s16(threshold);
+    while (end >= 8) {
+        uint16x8_t above = vcgtq_s16(vqabsq_s16(vld1q_s16(x + end - 8)), vt);
+        uint64x2_t wide = vreinterpretq_u64_u16(above);
+        if (vgetq_lane_u64(wide, 0) | vgetq_lane_u64(wide, 1)) break;
+        end -= 8;
+    }
+#endif
+    for (; end > 0; --end) {
+        if (std::abs(static_cast<int32_t>(x[end - 1])) > threshold) return end;
+    }
+    return 0;
+}
+
+// dst = fadeOut * (1 - r) + fadeIn * r, r ramping linearly from 0 to 1
+inline void crossfade(const float* fadeOut, const float* fadeIn, float* dst, size_t n) {
+    if (n == 0) return;
+    const float step = 1.0f / static_cast<float>(n);
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128 r = _mm_set_ps(3 * step, 2 * step, step, 0.0f);
+    const __m128 dr = _mm_set1_ps(4 * step);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 a = _mm_loadu_ps(fadeOut + i);
+        const __m128 b = _mm_loadu_ps(fadeIn + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(a, _mm_mul_ps(r, _mm_sub_ps(b, a))));
+        r = _mm_add_ps(r, dr);
+    }
+#elif defined(__ARM_NEON)
+    const float init[4] = {0.0f, step, 2 * step, 3 * step};
+    float32x4_t r = vld1q_f32(init);
+    const float32x4_t dr = vdupq_n_f32(4 * step);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t a = vld1q_f32(fadeOut + i);
+        const float32x4_t b = vld1q_f32(fadeIn + i);
+        vst1q_f32(dst + i, vmlaq_f32(a, r, vsubq_f32(b, a)));
+        r = vaddq_f32(r, dr);
+    }
+#endif
+    for (; i < n; ++i) {
+        const float r1 = static_cast<float>(i) * step;
+        dst[i] = fadeOut[i] + r1 * (fadeIn[i] - fadeOut[i]);
+    }
+}
+
+// acc += x * g, x in PCM16 and g ramping linearly from gainStart towards
+// gainEnd over the n samples. Used to sum streams into a mix bus; the bus
+// saturates once, in floatToInt16.
+inline void mixInto(const int16_t* x, float* acc, float gainStart, float gainEnd, size_t n) {
+    if (n == 0) return;
+    const float g0 = gainStart / 32768.0f;
+    const float step = (gainEnd - gainStart) / 32768.0f / static_cast<float>(n);
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128 g = _mm_set_ps(g0 + 3 * step, g0 + 2 * step, g0 + step, g0);
+    const __m128 dg = _mm_set1_ps(4 * step);
+    for (; i + 8 <= n; i += 8) {
+        // Sign-extend the eight samples to two vectors of int32
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+        const __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        const __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(lo, g)));
+        g = _mm_add_ps(g, dg);
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(hi, g)));
+        g = _mm_add_ps(g, dg);
+    }
+#elif defined(__ARM_NEON)
+    const float init[4] = {g0, g0 + step, g0 + 2 * step, g0 + 3 * step};
+    float32x4_t g = vld1q_f32(init);
+    const float32x4_t dg = vdupq_n_f32(4 * step);
+    for (; i + 8 <= n; i += 8) {
+        const int16x8_t v = vld1q_s16(x + i);
+        const float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        const float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        vst1q_f32(acc + i, vmlaq_f32(vld1q_f32(acc + i), lo, g));
+        g = vaddq_f32(g, dg);
+        vst1q_f32(acc + i + 4, vmlaq_f32(vld1q_f32(acc + i + 4), hi, g));
+        g = vaddq_f32(g, dg);
+    }
+#endif
+    for (; i < n; ++i) {
+        acc[i] += static_cast<float>(x[i]) * (g0 + step * static_cast<float>(i));
+    }
+}
+
+// Halves the sample rate: a 31-tap windowed-sinc half-band low-pass at a
+// quarter of the input rate, keeping every other output. Writes n / 2
+// samples; the edges are filtered as if the first and last samples repeat.
+inline void decimate2(const float* in, size_t n, float* out) {
+    constexpr size_t taps = 31;
+    constexpr size_t half = taps / 2;
+    static const std::array<float, taps> h = []() {
+        std::array<float, taps> c{};
+        const double pi = 3.14159265358979323846;
+        double sum = 0.0;
+        for (size_t k = 0; k < taps; ++k) {
+            const double t = static_cast<double>(k) - half;
+            const double sinc = t == 0.0 ? 1.0 : std::sin(pi * t / 2) / (pi * t / 2);
+            const double blackman = 0.42 - 0.5 * std::cos(2 * pi * k / (taps - 1)) +
+                                    0.08 * std::cos(4 * pi * k / (taps - 1));
+            c[k] = static_cast<float>(sinc * blackman);
+            sum += c[k];
+        }
+        for (float& v : c) v = static_cast<float>(v / sum);
+        return c;
+    }();
+
+    for (size_t i = 0; i < n / 2; ++i) {
+        const size_t center = 2 * i;
+        if (center >= half && center + half < n) {
+            // Symmetric, so the dot product is the convolution
+            out[i] = dotProduct(in + center - half, h.data(), taps);
+            continue;
+        }
+        float acc = 0.0f;
+        for (size_t k = 0; k < taps; ++k) {
+            const ptrdiff_t j = static_cast<ptrdiff_t>(center + k) - static_cast<ptrdiff_t>(half);
+            acc += h[k] * in[std::clamp<ptrdiff_t>(j, 0, static_cast<ptrdiff_t>(n) - 1)];
+        }
+        out[i] = acc;
+    }
+}
+
+// Linear-interpolating sample rate conversion. Good enough for echo
+// reference signals; not meant for listening material.
+inline std::vector<float> resampleLinear(const float* in, size_t n, int fromRate, int toRate) {
+    if (n == 0 || fromRate <= 0 || toRate <= 0) return {};
+    if (fromRate == toRate) return std::vector<float>(in, in + n);
+
+    const size_t outLen = static_cast<size_t>(static_cast<double>(n) * toRate / fromRate);
+    std::vector<float> out(outLen);
+    const double step = static_cast<double>(fromRate) / toRate;
+    for (size_t i = 0; i < outLen; ++i) {
+        double pos = i * step;
+        size_t idx = static_cast<size_t>(pos);
+        float frac = static_cast<float>(pos - idx);
+        float a = in[std::min(idx, n - 1)];
+        float b = in[std::min(idx + 1, n - 1)];
+        out[i] = a + (b - a) * frac;
+    }
+    return out;
+}
+
+} // namespace dsp
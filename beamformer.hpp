@@ -0,0 +1,137 @@
+#pragma once
+
+#include "audio_dsp.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Delay-and-sum beamformer for microphone arrays.
+//
+// Each channel is shifted by an integer steering delay and the channels are
+// averaged, which reinforces sound arriving from the steered direction and
+// attenuates diffuse noise. Delays come from the array geometry (BEAM_DELAYS)
+// or are estimated per chunk by cross-correlating every channel against
+// channel 0. An estimated delay only replaces the current one when its
+// normalized correlation is high enough and clearly better, and a channel
+// whose delay changes is crossfaded from the old alignment to the new one
+// over the chunk, so steering never jumps mid-signal. A per-channel history
+// keeps the shifts seamless across chunks.
+class DelayAndSumBeamformer {
+public:
+    // Largest array it is meant for; every channel is correlated per chunk
+    static constexpr size_t maxChannels = 16;
+
+    struct Config {
+        size_t channels = 1;
+        std::vector<int> delays;    // Fixed steering delays in samples; empty = auto
+        int maxLag = 16;            // Auto-steering search range (~1 ms at 16 kHz)
+        float minCorrelation = 0.5f;    // Normalized correlation a new delay needs
+        float hysteresis = 0.1f;        // ... and by how much it must beat the current one
+    };
+
+    explicit DelayAndSumBeamformer(const Config& cfg) : config(cfg) {
+        const size_t history = static_cast<size_t>(2 * std::max(cfg.maxLag, maxFixedDelay()));
+        channelData.assign(cfg.channels, std::vector<float>());
+        tails.assign(cfg.channels, std::vector<float>(history, 0.0f));
+        steering = cfg.delays;
+        steering.resize(cfg.channels, 0);
+        applied = steering;
+    }
+
+    // interleaved holds frames * channels PCM16 samples; out receives frames
+    // mono samples
+    void process(const int16_t* interleaved, size_t frames, std::vector<int16_t>& out) {
+        const size_t channels = config.channels;
+        const size_t history = tails.empty() ? 0 : tails[0].size();
+
+        // Deinterleave behind the previous chunk's tail
+        for (size_t c = 0; c < channels; ++c) {
+            std::vector<float>& data = channelData[c];
+            data.resize(history + frames);
+            std::copy(tails[c].begin(), tails[c].end(), data.begin());
+            float* dst = data.data() + history;
+            for (size_t i = 0; i < frames; ++i) {
+                dst[i] = interleaved[i * channels + c] * (1.0f / 32768.0f);
+            }
+        }
+
+        if (config.delays.empty() && channels > 1) {
+            steer(history, frames);
+        }
+
+        // Sum with the steering shift; the reference channel sits in the
+        // middle of the history so shifts in both directions stay in range
+        const int base = static_cast<int>(history / 2);
+        const float gain = 1.0f / static_cast<float>(channels);
+        mix.assign(frames, 0.0f);
+        for (size_t c = 0; c < channels; ++c) {
+            const int offset = std::clamp(base - steering[c], 0, static_cast<int>(history));
+            if (applied[c] == steering[c]) {
+                dsp::axpy(gain, channelData[c].data() + offset, mix.data(), frames);
+                continue;
+            }
+            const int previous = std::clamp(base - applied[c], 0, static_cast<int>(history));
+            aligned.resize(frames);
+            dsp::crossfade(channelData[c].data() + previous, channelData[c].data() + offset, aligned.data(), frames);
+            dsp::axpy(gain, aligned.data(), mix.data(), frames);
+            applied[c] = steering[c];
+        }
+
+        out.resize(frames);
+        dsp::floatToInt16(mix.data(), out.data(), frames);
+
+        for (size_t c = 0; c < channels; ++c) {
+            const std::vector<float>& data = channelData[c];
+            std::copy(data.end() - history, data.end(), tails[c].begin());
+        }
+    }
+
+    const std::vector<int>& steeringDelays() const { return steering; }
+
+private:
+    int maxFixedDelay() const {
+        int m = 0;
+        for (int d : config.delays) m = std::max(m, std::abs(d));
+        return m;
+    }
+
+    // Finds, per channel, the lag that best aligns it with channel 0 by
+    // normalized correlation, and moves to it only if it is a clear win over
+    // the current lag
+    void steer(size_t history, size_t frames) {
+        const float* ref = channelData[0].data() + history;
+        const int maxLag = std::min(config.maxLag, static_cast<int>(history / 2));
+        const size_t n = frames > static_cast<size_t>(maxLag) ? frames - maxLag : 0;
+        const float refEnergy = dsp::dotProduct(ref, ref, n);
+        if (n == 0 || refEnergy <= 1e-8f) return;      // Silence says nothing about direction
+        for (size_t c = 1; c < config.channels; ++c) {
+            float best = -1.0f;
+            float current = -1.0f;
+            int bestLag = 0;
+            for (int lag = -maxLag; lag <= maxLag; ++lag) {
+                const float* sig = channelData[c].data() + history - lag;
+                const float energy = dsp::dotProduct(sig, sig, n);
+                const float score = energy > 1e-8f ? dsp::dotProduct(ref, sig, n) / std::sqrt(refEnergy * energy) : 0.0f;
+                if (lag == steering[c]) current = score;
+                if (score > best) {
+                    best = score;
+                    bestLag = lag;
+                }
+            }
+            if (best >= config.minCorrelation && best >= current + config.hysteresis) {
+                steering[c] = bestLag;
+            }
+        }
+    }
+
+    Config config;
+    std::vector<int> steering;
+    std::vector<int> applied;       // Delays the previous chunk was mixed with
+    std::vector<std::vector<float>> channelData;
+    std::vector<std::vector<float>> tails;
+    std::vector<float> mix;
+    std::vector<float> aligned;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <websocketpp/frame.hpp>
+
+#include "metrics.hpp"
+
+// Reusable buffers for the audio message path.
+//
+// Long-running clients on the robots must not churn the heap once they reach
+// steady state: every chunk used to allocate a sample vector, a base64 string,
+// a stringstream and a JSON string. The pools below keep those buffers (and
+// their capacity) alive across chunks.
+
+// Pool of default-constructible containers (std::vector, std::string, ...).
+// acquire() hands out a buffer that returns itself to the pool when the
+// handle goes out of scope; the contents are left as they were so callers
+// should clear()/resize() before use.
+template <typename T>
+class ObjectPool : public std::enable_shared_from_this<ObjectPool<T>> {
+public:
+    // Returns the buffer to its pool, or frees it if the pool is gone
+    struct Releaser {
+        std::weak_ptr<ObjectPool> pool;
+        void operator()(T* p) const {
+            if (auto self = pool.lock()) {
+                self->release(p);
+            } else {
+                delete p;
+            }
+        }
+    };
+    using Handle = std::unique_ptr<T, Releaser>;
+
+    static std::shared_ptr<ObjectPool> create(size_t maxIdle = 8) {
+        return std::shared_ptr<ObjectPool>(new ObjectPool(maxIdle));
+    }
+
+    Handle acquire() {
+        std::unique_ptr<T> item;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty()) {
+                item = std::move(idle.back());
+                idle.pop_back();
+            }
+        }
+        if (!item) {
+            item = std::make_unique<T>();
+            ++allocations;
+        }
+
+        return Handle(item.release(), Releaser{this->weak_from_this()});
+    }
+
+    // Fills the pool with `count` buffers resized to `elements` so their
+    // pages are faulted in (and lockable) before the first chunk
+    void preallocate(size_t count, size_t elements) {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (idle.size() < std::min(count, maxIdle)) {
+            auto item = std::make_unique<T>();
+            item->resize(elements);
+            idle.push_back(std::move(item));
+            ++allocations;
+        }
+    }
+
+    // Number of buffers ever allocated; flat in steady state
+    size_t allocationCount() const { return allocations; }
+
+private:
+    explicit ObjectPool(size_t maxIdle) : maxIdle(maxIdle) {}
+
+    void release(T* p) {
+        std::unique_ptr<T> item(p);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() < maxIdle) {
+            idle.push_back(std::move(item));
+        }
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<T>> idle;
+    size_t maxIdle;
+    size_t allocations = 0;
+};
+
+// websocketpp message manager that recycles messages, plugged in as the
+// con_msg_manager_type of TlsDeflateClientConfig. The stock manager
+// (message_buffer::alloc) allocates a fresh message, payload and all, for
+// every frame; in particular connection::send() prepares each outgoing
+// message by masking it into a new one. This one hands out a message nobody
+// else references any more, with its payload capacity intact, so in steady
+// state frames are built in buffers that already exist. Fresh allocations
+// are counted in ws.msg_allocations.
+template <typename message>
+class PooledMessageManager : public std::enable_shared_from_this<PooledMessageManager<message>> {
+public:
+    typedef PooledMessageManager<message> type;
+    typedef std::shared_ptr<type> ptr;
+    typedef std::weak_ptr<type> weak_ptr;
+    typedef typename message::ptr message_ptr;
+
+    explicit PooledMessageManager(size_t maxMessages = 8) : maxMessages(maxMessages) {}
+
+    // Outgoing frames: prepare_data_frame sets the opcode
+    message_ptr get_message() {
+        return get_message(websocketpp::frame::opcode::text, 0);
+    }
+
+    message_ptr get_message(websocketpp::frame::opcode::value op, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const message_ptr& msg : messages) {
+            // Only the pool holds it, and only the pool can hand it out again
+            if (msg.use_count() == 1) {
+                reset(*msg, op, size);
+                return msg;
+            }
+        }
+
+        // The message's manager link only serves message::recycle(), which
+        // websocketpp never calls; the pool tracks reuse itself
+        message_ptr msg = std::make_shared<message>(typename message::con_msg_man_ptr(), op, size);
+        Metrics::instance().add("ws.msg_allocations");
+        if (messages.size() < maxMessages) {
+            messages.push_back(msg);
+        }
+        return msg;
+    }
+
+    bool recycle(message*) {
+        return false;
+    }
+
+private:
+    static void reset(message& msg, websocketpp::frame::opcode::value op, size_t size) {
+        msg.set_opcode(op);
+        msg.set_prepared(false);
+        msg.set_fin(true);
+        msg.set_terminal(false);
+        msg.set_compressed(false);
+        msg.set_header("");
+        std::string& payload = msg.get_raw_payload();
+        payload.clear();
+        if (payload.capacity() < size) {
+            payload.reserve(size);
+        }
+    }
+
+    std::mutex mutex;
+    std::vector<message_ptr> messages;
+    size_t maxMessages;
+};
+
+// Messages the caller serializes into before handing them to
+// endpoint::send(). Unprepared messages are masked into a second message
+// from the connection's manager; with PooledMessageManager on both sides
+// neither buffer is reallocated per frame.
+template <typename Config>
+class MessagePool {
+public:
+    using message_type = typename Config::message_type;
+    using message_ptr = typename message_type::ptr;
+
+    explicit MessagePool(size_t maxMessages = 4)
+        : manager(std::make_shared<PooledMessageManager<message_type>>(maxMessages)) {}
+
+    // Returns an empty message with at least `reserve` bytes of capacity
+    message_ptr acquire(websocketpp::frame::opcode::value op, size_t reserve = 0) {
+        return manager->get_message(op, reserve);
+    }
+
+private:
+    std::shared_ptr<PooledMessageManager<message_type>> manager;
+};
+
+// Appends the base64 encoding of data to out without temporaries
+inline void appendBase64(std::string& out, const unsigned char* data, size_t size) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    const size_t start = out.size();
+    out.resize(start + (size + 2) / 3 * 4);
+    char* dst = &out[start];
+
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        const uint32_t v = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+        *dst++ = table[(v >> 18) & 0x3f];
+        *dst++ = table[(v >> 12) & 0x3f];
+        *dst++ = table[(v >> 6) & 0x3f];
+        *dst++ = table[v & 0x3f];
+    }
+    if (i < size) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < size) v |= uint32_t(data[i + 1]) << 8;
+        *dst++ = table[(v >> 18) & 0x3f];
+        *dst++ = table[(v >> 12) & 0x3f];
+        *dst++ = i + 1 < size ? table[(v >> 6) & 0x3f] : '=';
+        *dst++ = '=';
+    }
+}
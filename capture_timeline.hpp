@@ -0,0 +1,247 @@
+#pragma once
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "json_util.hpp"
+#include "metrics.hpp"
+
+// Timing for the capture stream sent by audio_uploader.
+//
+// CaptureTimeline numbers every captured frame: a chunk's sample index is its
+// position on a continuous timeline at the device rate, so samples lost to
+// overruns or capture restarts show up as a jump in the index (gapSamples)
+// rather than silently shifting everything after them. Chunk start times are
+// derived from the sample clock, anchored to steady_clock, and a least-squares
+// fit of chunk arrival against sample count gives the drift of the ALSA clock
+// against the system clock.
+//
+// ClockSync estimates the offset from steady_clock to the server's clock with
+// NTP-style clock_ping/clock_pong exchanges, keeping the sample with the
+// lowest round trip out of the last few.
+
+inline int64_t steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class CaptureTimeline {
+public:
+    struct Config {
+        uint32_t sampleRate = 16000;
+        std::chrono::milliseconds gapThreshold{100};   // Arrival later than predicted by this much is a gap
+        size_t driftWindow = 64;                       // Chunks in the drift fit
+        std::chrono::seconds minDriftSpan{60};         // Audio the fit must cover before it is reported
+    };
+
+    struct Chunk {
+        uint64_t sampleIndex = 0;   // Timeline position of the first frame
+        uint64_t frames = 0;
+        uint32_t sampleRate = 0;
+        uint64_t gapSamples = 0;    // Frames missing right before this chunk
+        int64_t startNs = 0;        // steady_clock time of the first frame
+        double driftPpm = 0.0;      // Sample clock vs system clock; > 0 means the device runs slow
+        bool driftValid = false;
+    };
+
+    CaptureTimeline() = default;
+    explicit CaptureTimeline(const Config& cfg) : config(cfg) {}
+
+    // Called when the last frame of a chunk has been read
+    Chunk onChunk(uint64_t frames, int64_t completedNs) {
+        Chunk chunk;
+        chunk.frames = frames;
+        chunk.sampleRate = config.sampleRate;
+
+        if (!started) {
+            started = true;
+            anchor(completedNs - framesToNs(frames), 0);
+        } else {
+            const int64_t expectedNs = timeAt(nextIndex + frames);
+            const int64_t excessNs = completedNs - expectedNs;
+            const int64_t thresholdNs = std::chrono::nanoseconds(config.gapThreshold).count();
+            if (excessNs > thresholdNs) {
+                // Frames the device never delivered: the capture was late by this much
+                chunk.gapSamples = static_cast<uint64_t>(std::llround(
+                    static_cast<double>(excessNs) * config.sampleRate / 1e9 / scale()));
+                nextIndex += chunk.gapSamples;
+                anchor(completedNs - framesToNs(frames), nextIndex);
+                Metrics& m = Metrics::instance();
+                m.add("capture.gaps");
+                m.add("capture.gap_ms", excessNs / 1e6);
+            } else if (excessNs < -thresholdNs) {
+                // Data earlier than the sample clock allows: the anchor was off
+                anchor(completedNs - framesToNs(frames), nextIndex);
+                Metrics::instance().add("capture.reanchors");
+            }
+        }
+
+        chunk.sampleIndex = nextIndex;
+        chunk.startNs = timeAt(nextIndex);
+        nextIndex += frames;
+
+        points.push_back({static_cast<double>(nextIndex - anchorIndex), static_cast<double>(completedNs - anchorNs)});
+        if (points.size() > config.driftWindow) points.pop_front();
+        updateDrift();
+        chunk.driftPpm = driftPpm;
+        chunk.driftValid = driftValid;
+        return chunk;
+    }
+
+    uint64_t nextSampleIndex() const { return nextIndex; }
+
+private:
+    struct Point {
+        double samples;     // Since the anchor
+        double ns;
+    };
+
+    void anchor(int64_t ns, uint64_t index) {
+        anchorNs = ns;
+        anchorIndex = index;
+        points.clear();
+    }
+
+    int64_t framesToNs(uint64_t frames) const {
+        return static_cast<int64_t>(static_cast<double>(frames) * 1e9 / config.sampleRate * scale());
+    }
+
+    // steady_clock time of timeline position `index`
+    int64_t timeAt(uint64_t index) const {
+        return anchorNs + framesToNs(index - anchorIndex);
+    }
+
+    double scale() const { return driftValid ? 1.0 + driftPpm * 1e-6 : 1.0; }
+
+    void updateDrift() {
+        if (points.size() < 3) return;
+        const double span = points.back().samples - points.front().samples;
+        if (span < static_cast<double>(config.minDriftSpan.count()) * config.sampleRate) return;
+
+        // Slope of arrival time against sample count, relative to the first point
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        const Point& p0 = points.front();
+        for (const Point& p : points) {
+            const double x = p.samples - p0.samples;
+            const double y = p.ns - p0.ns;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        const double n = static_cast<double>(points.size());
+        const double denom = n * sxx - sx * sx;
+        if (denom <= 0) return;
+        const double nsPerSample = (n * sxy - sx * sy) / denom;
+
+        driftPpm = (nsPerSample * config.sampleRate / 1e9 - 1.0) * 1e6;
+        driftValid = true;
+        Metrics::instance().set("capture.drift_ppm", driftPpm);
+    }
+
+    Config config;
+    bool started = false;
+    int64_t anchorNs = 0;
+    uint64_t anchorIndex = 0;
+    uint64_t nextIndex = 0;
+    std::deque<Point> points;
+    double driftPpm = 0.0;
+    bool driftValid = false;
+};
+
+class ClockSync {
+public:
+    // Exchanges the min-RTT filter looks at
+    static constexpr size_t kWindow = 8;
+
+    // True when `interval` has passed since the last ping
+    bool due(int64_t nowNs, std::chrono::milliseconds interval) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nowNs - lastPingNs >= std::chrono::nanoseconds(interval).count();
+    }
+
+    // {"type":"clock_ping","id":N,"t0":<device ms>}; the server answers with
+    // clock_pong echoing id and t0 and adding t1 (receipt) and t2 (reply) in
+    // its own milliseconds
+    std::string makePing(int64_t nowNs = steadyNs()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        lastPingNs = nowNs;
+        const uint64_t id = ++lastId;
+        outstanding[id] = nowNs;
+        while (outstanding.size() > kWindow) outstanding.erase(outstanding.begin());
+        return "{\"type\":\"clock_ping\",\"id\":" + std::to_string(id) + ",\"t0\":" + formatMs(nowNs) + "}";
+    }
+
+    // Returns true if the message was a clock_pong
+    bool handleMessage(const std::string& message, int64_t nowNs = steadyNs()) {
+        if (json::getString(message, "type") != "clock_pong") return false;
+
+        const uint64_t id = static_cast<uint64_t>(json::getNumber(message, "id", 0));
+        const double t1 = json::getNumber(message, "t1", NAN);
+        const double t2 = json::getNumber(message, "t2", std::isnan(t1) ? NAN : t1);
+        if (std::isnan(t1)) return true;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = outstanding.find(id);
+        if (it == outstanding.end()) return true;
+        const double t0 = it->second / 1e6;
+        const double t3 = nowNs / 1e6;
+        outstanding.erase(it);
+
+        Sample s;
+        s.rttMs = (t3 - t0) - (t2 - t1);
+        s.offsetMs = ((t1 - t0) + (t2 - t3)) / 2.0;
+        if (s.rttMs < 0) return true;
+        samples.push_back(s);
+        if (samples.size() > kWindow) samples.pop_front();
+
+        // The exchange with the shortest round trip has the least queueing in it
+        const Sample* best = &samples.front();
+        for (const Sample& c : samples) {
+            if (c.rttMs < best->rttMs) best = &c;
+        }
+        offsetMs = best->offsetMs;
+        synced = true;
+
+        Metrics& m = Metrics::instance();
+        m.add("clock.syncs");
+        m.set("clock.rtt_ms", s.rttMs);
+        m.set("clock.offset_ms", offsetMs);
+        return true;
+    }
+
+    // Server time in ms for a steady_clock instant; false until the first pong
+    bool toServerMs(int64_t deviceNs, double& serverMs) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!synced) return false;
+        serverMs = deviceNs / 1e6 + offsetMs;
+        return true;
+    }
+
+    static std::string formatMs(int64_t ns) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.3f", ns / 1e6);
+        return buf;
+    }
+
+private:
+    struct Sample {
+        double rttMs;
+        double offsetMs;
+    };
+
+    mutable std::mutex mutex;
+    int64_t lastPingNs = INT64_MIN / 2;
+    uint64_t lastId = 0;
+    std::map<uint64_t, int64_t> outstanding;    // id -> t0
+    std::deque<Sample> samples;
+    double offsetMs = 0.0;
+    bool synced = false;
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "audio_dsp.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Acoustic echo canceller for the capture path.
+//
+// The reference signal is whatever speak played through the speaker. The
+// bulk playback-to-microphone delay is estimated by cross-correlation, then a
+// normalized LMS filter models the remaining room response and subtracts the
+// echo estimate from the microphone signal. Adaptation is frozen while the
+// near-end talker dominates (Geigel double-talk detector) so barge-in speech
+// does not get cancelled along with the echo. The bulk delay is re-estimated
+// every chunk but only followed when it has clearly moved; the filter
+// weights are then shifted by the same amount so the converged room
+// response stays in place.
+class EchoCanceller {
+public:
+    struct Config {
+        size_t taps = 512;          // Echo tail length in samples (32 ms @ 16 kHz)
+        float stepSize = 0.3f;      // NLMS mu, 0 < mu < 2
+        size_t maxDelay = 8000;     // Bulk delay search range in samples
+        size_t decimation = 4;      // Coarse delay search works on decimated signals
+        float doubleTalkRatio = 0.5f;  // Assumes ~6 dB speaker-to-mic coupling loss
+    };
+
+    EchoCanceller() : EchoCanceller(Config{}) {}
+
+    explicit EchoCanceller(const Config& cfg)
+        : config(cfg),
+          weights(cfg.taps, 0.0f),
+          history(cfg.taps * 2, 0.0f) {}
+
+    // Returns the bulk delay (in samples, 0..maxLag) to remove from reference
+    // so that mic[i] ~ reference[i + maxLag - lag]. The reference buffer must
+    // hold maxLag samples of lead-in before the first mic sample. The result
+    // sits a quarter filter length before the correlation peak so early
+    // reflections stay inside the (causal) adaptive filter.
+    size_t estimateDelay(const float* mic, const float* reference, size_t n, size_t maxLag) const {
+        const size_t dec = std::max<size_t>(1, config.decimation);
+        const size_t coarseN = n / dec;
+        const size_t coarseLag = maxLag / dec;
+        if (coarseN == 0) return 0;
+
+        std::vector<float>& micDec = decimate(mic, n, dec, micScratch);
+        std::vector<float>& refDec = decimate(reference, n + maxLag, dec, refScratch);
+
+        size_t best = 0;
+        float bestScore = -1.0f;
+        for (size_t lag = 0; lag <= coarseLag; ++lag) {
+            const float* ref = refDec.data() + (coarseLag - lag);
+            const size_t len = std::min(coarseN, refDec.size() - (coarseLag - lag));
+            float score = std::fabs(dsp::dotProduct(micDec.data(), ref, len));
+            if (score > bestScore) {
+                bestScore = score;
+                best = lag;
+            }
+        }
+
+        // Refine around the coarse peak at full rate
+        size_t fineBest = best * dec;
+        bestScore = -1.0f;
+        const size_t lo = fineBest >= dec ? fineBest - dec : 0;
+        const size_t hi = std::min(maxLag, fineBest + dec);
+        for (size_t lag = lo; lag <= hi; ++lag) {
+            float score = std::fabs(dsp::dotProduct(mic, reference + (maxLag - lag), n));
+            if (score > bestScore) {
+                bestScore = score;
+                fineBest = lag;
+            }
+        }
+        const size_t margin = config.taps / 4;
+        return fineBest > margin ? fineBest - margin : 0;
+    }
+
+    // Estimates the bulk delay, follows it if it moved, and cancels echo in
+    // place. reference holds maxLag samples of lead-in before the first mic
+    // sample, as for estimateDelay(). Returns the bulk delay used.
+    size_t cancel(float* mic, const float* reference, size_t n, size_t maxLag) {
+        const size_t estimate = estimateDelay(mic, reference, n, maxLag);
+        const size_t tolerance = std::max<size_t>(1, config.taps / 8);
+        auto near = [tolerance](size_t a, size_t b) { return (a > b ? a - b : b - a) <= tolerance; };
+
+        if (!haveDelay) {
+            haveDelay = true;
+            delay = estimate;
+            realign(reference + (maxLag - delay), maxLag - delay);
+        } else if (near(estimate, delay)) {
+            candidateSeen = false;
+        } else if (candidateSeen && near(estimate, candidate)) {
+            // Two chunks in a row agree on a new delay: move to it
+            shiftWeights(static_cast<long>(estimate) - static_cast<long>(delay));
+            delay = estimate;
+            candidateSeen = false;
+            realign(reference + (maxLag - delay), maxLag - delay);
+        } else {
+            candidate = estimate;
+            candidateSeen = true;
+        }
+
+        process(mic, reference + (maxLag - delay), n);
+        return delay;
+    }
+
+    // Cancels echo in place. reference must be aligned with mic (bulk delay
+    // already removed) and hold at least n samples. Filter weights persist
+    // across calls so convergence carries over from chunk to chunk.
+    void process(float* mic, const float* reference, size_t n) {
+        const size_t L = config.taps;
+        constexpr float eps = 1e-6f;
+
+        for (size_t i = 0; i < n; ++i) {
+            // Double-buffered delay line keeps the last L reference samples
+            // contiguous (newest first) without shifting.
+            pos = pos == 0 ? L - 1 : pos - 1;
+            const float dropped = history[pos];
+            const float x = reference[i];
+            history[pos] = x;
+            history[pos + L] = x;
+            power += x * x - dropped * dropped;
+            if (power < 0.0f) power = 0.0f;
+
+            const float* window = history.data() + pos;
+            const float echo = dsp::dotProduct(weights.data(), window, L);
+            const float d = mic[i];
+            const float e = d - echo;
+            mic[i] = e;
+
+            // Geigel: near-end speech is louder than any recent far-end peak
+            const float farPeak = recentPeak(x);
+            if (std::fabs(d) > config.doubleTalkRatio * farPeak) {
+                continue;
+            }
+            dsp::axpy(config.stepSize * e / (power + eps), window, weights.data(), L);
+        }
+    }
+
+    void reset() {
+        std::fill(weights.begin(), weights.end(), 0.0f);
+        std::fill(history.begin(), history.end(), 0.0f);
+        power = 0.0f;
+        pos = 0;
+        peak = 0.0f;
+        haveDelay = false;
+        candidateSeen = false;
+    }
+
+    const Config& getConfig() const { return config; }
+
+private:
+    // Weight k models the echo at bulk delay + k; a bulk delay `delta`
+    // samples longer moves every weight delta taps earlier
+    void shiftWeights(long delta) {
+        const long L = static_cast<long>(weights.size());
+        if (delta >= L || -delta >= L) {
+            std::fill(weights.begin(), weights.end(), 0.0f);
+        } else if (delta > 0) {
+            std::copy(weights.begin() + delta, weights.end(), weights.begin());
+            std::fill(weights.end() - delta, weights.end(), 0.0f);
+        } else if (delta < 0) {
+            std::copy_backward(weights.begin(), weights.end() + delta, weights.end());
+            std::fill(weights.begin(), weights.begin() - delta, 0.0f);
+        }
+    }
+
+    // Refills the delay line with the `available` reference samples right
+    // before `start` (zeros where there are none), so it matches the new
+    // alignment instead of the old one
+    void realign(const float* start, size_t available) {
+        const size_t L = config.taps;
+        std::fill(history.begin(), history.end(), 0.0f);
+        pos = 0;
+        power = 0.0f;
+        for (size_t k = 0; k < L && k < available; ++k) {
+            const float x = start[-1 - static_cast<long>(k)];     // Newest first
+            history[k] = x;
+            history[k + L] = x;
+            power += x * x;
+        }
+    }
+
+    // Box-filter decimation into a reusable scratch buffer
+    static std::vector<float>& decimate(const float* in, size_t n, size_t factor, std::vector<float>& out) {
+        out.resize(n / factor);
+        for (size_t i = 0; i < out.size(); ++i) {
+            float acc = 0.0f;
+            for (size_t k = 0; k < factor; ++k) {
+                acc += in[i * factor + k];
+            }
+            out[i] = acc;
+        }
+        return out;
+    }
+
+    float recentPeak(float x) {
+        // Exponentially decaying peak hold over roughly one filter length
+        const float decay = 1.0f - 1.0f / static_cast<float>(config.taps);
+        peak = std::max(std::fabs(x), peak * decay);
+        return peak;
+    }
+
+    Config config;
+    std::vector<float> weights;
+    std::vector<float> history;
+    size_t pos = 0;
+    float power = 0.0f;
+    float peak = 0.0f;
+    bool haveDelay = false;
+    size_t delay = 0;               // Bulk delay in use
+    bool candidateSeen = false;     // A different delay was estimated last chunk
+    size_t candidate = 0;
+    // Delay estimation scratch, kept to avoid per-chunk allocations
+    mutable std::vector<float> micScratch;
+    mutable std::vector<float> refScratch;
+};
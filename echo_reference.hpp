@@ -0,0 +1,139 @@
+#pragma once
+
+#include "audio_dsp.hpp"
+#include "wav_file.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Playback reference exchange between speak (which plays TTS audio) and
+// audio_uploader (which needs that audio as the echo canceller reference).
+//
+// speak drops a copy of every file it is about to play into a shared
+// directory, named after the wall-clock millisecond the playback starts:
+//     <dir>/ref_<epoch_ms>.wav
+// The uploader collects the files overlapping a capture window and renders
+// them onto the capture timeline.
+namespace echo_ref {
+
+inline int64_t nowEpochMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Removes reference files older than maxAgeMs. Both sides call this so the
+// directory stays bounded even if one of the processes is not running.
+inline void pruneReferences(const std::string& dir, int64_t maxAgeMs) {
+    std::error_code ec;
+    if (!std::filesystem::exists(dir, ec)) return;
+
+    const int64_t cutoff = nowEpochMs() - maxAgeMs;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("ref_", 0) != 0) continue;
+        try {
+            int64_t startMs = std::stoll(name.substr(4));
+            if (startMs < cutoff) {
+                std::filesystem::remove(entry.path(), ec);
+            }
+        } catch (...) {
+            // Not one of ours
+        }
+    }
+}
+
+// Called by the playback side right before the audio starts.
+inline bool publishReference(const std::string& dir, const std::string& wavFile) {
+    if (dir.empty()) return false;
+
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    pruneReferences(dir, 30000);
+
+    const std::string target = dir + "/ref_" + std::to_string(nowEpochMs()) + ".wav";
+    std::filesystem::copy_file(wavFile, target,
+                               std::filesystem::copy_options::overwrite_existing, ec);
+    return !ec;
+}
+
+// Loads a PCM16 WAV, mixes it to mono and returns normalized float samples.
+// Anything that is not 16-bit PCM is rejected.
+inline bool loadPcm16Mono(const std::string& path, std::vector<float>& samples, int& sampleRate) {
+    try {
+        WavReader wav(path);
+        const int16_t* pcm = wav.samples();
+        if (!pcm) return false;
+
+        const size_t channels = wav.format().channels;
+        const size_t frames = wav.sampleCount() / channels;
+        sampleRate = static_cast<int>(wav.format().sampleRate);
+        samples.assign(frames, 0.0f);
+        if (channels == 1) {
+            dsp::int16ToFloat(pcm, samples.data(), frames);
+            return true;
+        }
+        for (size_t i = 0; i < frames; ++i) {
+            float acc = 0.0f;
+            for (size_t c = 0; c < channels; ++c) {
+                acc += pcm[i * channels + c];
+            }
+            samples[i] = acc / (32768.0f * channels);
+        }
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Renders all playback overlapping [startMs - leadMs, startMs + n/rate) onto a
+// buffer at the capture sample rate. Index leadSamples corresponds to the
+// first captured sample. Returns false when nothing was playing.
+inline bool renderReference(const std::string& dir, int64_t startMs, size_t n, int rate,
+                            size_t leadSamples, std::vector<float>& out) {
+    out.assign(n + leadSamples, 0.0f);
+    std::error_code ec;
+    if (dir.empty() || !std::filesystem::exists(dir, ec)) return false;
+
+    const int64_t windowStartMs = startMs - static_cast<int64_t>(leadSamples) * 1000 / rate;
+    const int64_t windowEndMs = startMs + static_cast<int64_t>(n) * 1000 / rate;
+    bool any = false;
+
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("ref_", 0) != 0) continue;
+
+        int64_t playMs = 0;
+        try {
+            playMs = std::stoll(name.substr(4));
+        } catch (...) {
+            continue;
+        }
+        if (playMs >= windowEndMs) continue;
+
+        std::vector<float> pcm;
+        int pcmRate = 0;
+        if (!loadPcm16Mono(entry.path().string(), pcm, pcmRate)) continue;
+
+        std::vector<float> resampled = dsp::resampleLinear(pcm.data(), pcm.size(), pcmRate, rate);
+        const int64_t playEndMs = playMs + static_cast<int64_t>(resampled.size()) * 1000 / rate;
+        if (playEndMs <= windowStartMs) continue;
+
+        // Position of the first playback sample in the output buffer
+        const int64_t offset = (playMs - windowStartMs) * rate / 1000;
+        for (size_t i = 0; i < resampled.size(); ++i) {
+            const int64_t j = offset + static_cast<int64_t>(i);
+            if (j < 0) continue;
+            if (j >= static_cast<int64_t>(out.size())) break;
+            out[static_cast<size_t>(j)] += resampled[i];
+        }
+        any = true;
+    }
+    return any;
+}
+
+} // namespace echo_ref
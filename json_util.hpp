@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// Minimal helpers for the flat JSON objects exchanged with the servers.
+// Like the rest of the code base this does key lookups on the raw text rather
+// than building a document tree; it is not a general JSON parser.
+namespace json {
+
+inline std::string escape(const std::string& in) {
+    std::string out;
+    out.reserve(in.size() + 8);
+    for (char c : in) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+// Position just past `"key":` (whitespace skipped), or npos
+inline size_t findValue(const std::string& text, const std::string& key, size_t from = 0) {
+    const std::string needle = "\"" + key + "\"";
+    size_t pos = text.find(needle, from);
+    while (pos != std::string::npos) {
+        size_t p = pos + needle.size();
+        while (p < text.size() && (text[p] == ' ' || text[p] == '\t')) ++p;
+        if (p < text.size() && text[p] == ':') {
+            ++p;
+            while (p < text.size() && (text[p] == ' ' || text[p] == '\t')) ++p;
+            return p;
+        }
+        pos = text.find(needle, pos + 1);
+    }
+    return std::string::npos;
+}
+
+// String value of key with the common escapes undone. Returns false if the
+// key is missing or not a string.
+inline bool getString(const std::string& text, const std::string& key, std::string& out, size_t from = 0) {
+    size_t p = findValue(text, key, from);
+    if (p == std::string::npos || p >= text.size() || text[p] != '"') return false;
+
+    out.clear();
+    for (++p; p < text.size(); ++p) {
+        char c = text[p];
+        if (c == '"') return true;
+        if (c == '\\' && p + 1 < text.size()) {
+            char e = text[++p];
+            switch (e) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u':
+                    // Non-ASCII text arrives as raw UTF-8 from our servers;
+                    // keep escaped code points as-is
+                    out += "\\u";
+                    break;
+                default: out += e;
+            }
+        } else {
+            out += c;
+        }
+    }
+    return false;
+}
+
+inline std::string getString(const std::string& text, const std::string& key, const std::string& def = "") {
+    std::string out;
+    return getString(text, key, out) ? out : def;
+}
+
+// Numeric (or boolean) value of key, or def when missing
+inline double getNumber(const std::string& text, const std::string& key, double def = 0.0) {
+    size_t p = findValue(text, key);
+    if (p == std::string::npos || p >= text.size()) return def;
+    if (text.compare(p, 4, "true") == 0) return 1.0;
+    if (text.compare(p, 5, "false") == 0) return 0.0;
+    char* end = nullptr;
+    double v = std::strtod(text.c_str() + p, &end);
+    return end == text.c_str() + p ? def : v;
+}
+
+} // namespace json
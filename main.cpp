@@ -1,9 +1,16 @@
 #include <websocketpp/client.hpp>
-#include <websocketpp/config/asio_client.hpp>  // Changed to support TLS
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/read.hpp>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
 #include <cstdlib>
 #include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -12,11 +19,27 @@
 #include <random>
 #include <iomanip>
 #include <chrono>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+#include "async_runtime.hpp"
+#include "beamformer.hpp"
+#include "buffer_pool.hpp"
+#include "capture_timeline.hpp"
+#include "echo_canceller.hpp"
+#include "echo_reference.hpp"
+#include "metrics.hpp"
+#include "realtime.hpp"
+#include "transcript_pipeline.hpp"
+#include "uplink_control.hpp"
+#include "wav_file.hpp"
+#include "ws_config.hpp"
 
 using namespace std::chrono_literals;
 
-// Define WebSocket client types for secure connections
-using Client = websocketpp::client<websocketpp::config::asio_tls_client>;
+// Define WebSocket client types for secure connections (with permessage-deflate)
+using Client = websocketpp::client<TlsDeflateClientConfig>;
 using ConnectionHdl = websocketpp::connection_hdl;
 using ErrorCode = websocketpp::lib::error_code;
 
@@ -37,47 +60,176 @@ static std::string generateClientId() {
     return ss.str();
 }
 
-static std::string getCurrentTimestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto itt = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&itt), "%FT%T");
-    return ss.str();
-}
-
-static std::string timestampedFilename() {
+// Appends an ISO-8601 local timestamp without going through a stringstream
+static void appendCurrentTimestamp(std::string& out) {
     std::time_t t = std::time(nullptr);
     std::tm tmStruct{};
     localtime_r(&t, &tmStruct);
-    char buf[64];
-    std::strftime(buf, sizeof(buf), "rec_%Y%m%d_%H%M%S.wav", &tmStruct);
-    return std::string(buf);
+    char buf[32];
+    size_t len = std::strftime(buf, sizeof(buf), "%FT%T", &tmStruct);
+    out.append(buf, len);
+}
+
+// Sample width of an arecord format name; 0 if unsupported
+static uint16_t bitsForFormat(const std::string& format) {
+    if (format == "S16_LE") return 16;
+    if (format == "S24_3LE") return 24;
+    if (format == "S32_LE") return 32;
+    return 0;
 }
 
-// Read WAV file into binary buffer
-static std::vector<char> readWavFile(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file) {
-        throw std::runtime_error("Failed to open file: " + filename);
+// arecord streaming raw frames to a pipe for as long as we are connected.
+// Reading from one long-lived capture keeps the sample clock continuous.
+// Both of its pipes are read on the event loop: chunks with asyncRead, and
+// stderr line by line so overruns are counted as they happen.
+class CaptureProcess {
+public:
+    // pipeBytes: room for the capture to run ahead while a chunk is processed
+    // Chunks complete on the runtime's strand
+    CaptureProcess(AsyncRuntime& runtime, std::vector<std::string> args, rt::Settings settings,
+                   size_t pipeBytes)
+        : ioc(runtime.context()), pipe(runtime.strand()), args(std::move(args)), settings(std::move(settings)), pipeBytes(pipeBytes) {}
+    
+    ~CaptureProcess() {
+        stop();
     }
     
-    // Get file size
-    file.seekg(0, std::ios::end);
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    bool running() const {
+        return proc.pid > 0;
+    }
     
-    // Read file content
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size)) {
-        throw std::runtime_error("Failed to read file: " + filename);
+    bool start() {
+        proc = rt::spawn(args, settings, true);
+        if (proc.pid < 0) return false;
+        // Best effort: the default 64 KiB is under a second of a 4-channel capture
+        fcntl(proc.outFd, F_SETPIPE_SZ, static_cast<int>(pipeBytes));
+        pipe.assign(proc.outFd);
+        watchStderr(ioc, proc.errFd, "capture.xruns");
+        proc.errFd = -1;
+        Metrics::instance().add("capture.starts");
+        return true;
     }
     
-    return buffer;
+    // Reads exactly `bytes`; the handler gets an error (eof) when the
+    // capture has ended
+    template <class Handler>
+    void asyncRead(char* dst, size_t bytes, Handler&& handler) {
+        boost::asio::async_read(pipe, boost::asio::buffer(dst, bytes), std::forward<Handler>(handler));
+    }
+    
+    // Captured bytes waiting in the pipe, i.e. how far behind the reader is
+    size_t pendingBytes() {
+        int n = 0;
+        return ioctl(pipe.native_handle(), FIONREAD, &n) == 0 && n > 0 ? static_cast<size_t>(n) : 0;
+    }
+    
+    void stop() {
+        if (proc.pid <= 0) return;
+        kill(proc.pid, SIGTERM);
+        boost::system::error_code ec;
+        pipe.close(ec);
+        int status = 0;
+        while (waitpid(proc.pid, &status, 0) < 0 && errno == EINTR) {}
+        proc = rt::Process();
+    }
+    
+private:
+    boost::asio::io_context& ioc;
+    boost::asio::posix::stream_descriptor pipe;
+    std::vector<std::string> args;
+    rt::Settings settings;
+    size_t pipeBytes;
+    rt::Process proc;
+};
+
+// Remove speaker playback (published by speak) from a mono PCM16 capture,
+// in place. Returns true when a reference was found and the samples were
+// modified.
+static bool cancelEcho(int16_t* pcm, size_t n, int rate, int64_t startMs, const std::string& refDir,
+                       EchoCanceller& aec, ObjectPool<std::vector<float>>& framePool) {
+    const size_t lead = aec.getConfig().maxDelay;
+    auto reference = framePool.acquire();
+    if (!echo_ref::renderReference(refDir, startMs, n, rate, lead, *reference)) return false;
+
+    auto mic = framePool.acquire();
+    mic->resize(n);
+    dsp::int16ToFloat(pcm, mic->data(), n);
+
+    const size_t delay = aec.cancel(mic->data(), reference->data(), n, lead);
+
+    dsp::floatToInt16(mic->data(), pcm, n);
+    std::cout << "Echo cancelled (bulk delay " << delay * 1000 / rate << " ms)\n";
+    return true;
+}
+
+// Sample rate audio captured at `rate` goes out at in `mode`
+static uint32_t uplinkRate(const UplinkController::Mode& mode, uint32_t rate) {
+    return mode.rateDivisor == 2 && rate % 2 == 0 ? rate / 2 : rate;
+}
+
+// The chunk's timeline fields counted at the rate it goes out at, so the
+// server's sample_index, frames and sample_rate always agree with the audio
+static CaptureTimeline::Chunk atUplinkRate(const CaptureTimeline::Chunk& chunk, uint32_t captureRate,
+                                           uint32_t sentRate) {
+    CaptureTimeline::Chunk scaled = chunk;
+    if (sentRate == captureRate || sentRate == 0) return scaled;
+    const uint64_t divisor = captureRate / sentRate;
+    scaled.sampleIndex /= divisor;
+    scaled.frames /= divisor;
+    scaled.gapSamples /= divisor;
+    scaled.sampleRate = sentRate;
+    return scaled;
+}
+
+// Mono PCM16 as it goes out in `mode`: the capture rate as is, or low-passed
+// and halved. fmt.sampleRate follows.
+static void reduceForUplink(const int16_t* pcm, size_t n, const UplinkController::Mode& mode, WavFormat& fmt,
+                            ObjectPool<std::vector<float>>& framePool, std::vector<int16_t>& out) {
+    if (uplinkRate(mode, fmt.sampleRate) == fmt.sampleRate) {
+        out.assign(pcm, pcm + n);
+        return;
+    }
+    auto in = framePool.acquire();
+    in->resize(n);
+    dsp::int16ToFloat(pcm, in->data(), n);
+    auto half = framePool.acquire();
+    half->resize(n / 2);
+    dsp::decimate2(in->data(), n, half->data());
+    out.resize(n / 2);
+    dsp::floatToInt16(half->data(), out.data(), n / 2);
+    fmt.sampleRate /= 2;
+}
+
+// Whether the voice gate of `mode` lets this chunk go out
+static bool admitForUplink(const int16_t* pcm, size_t n, uint32_t rate, const UplinkController::Mode& mode,
+                           UplinkController& uplink, ObjectPool<std::vector<float>>& framePool) {
+    auto x = framePool.acquire();
+    if (mode.vadDb < 0.0f) {
+        x->resize(n);
+        dsp::int16ToFloat(pcm, x->data(), n);
+    }
+    return uplink.admit(mode, x->data(), x->size(), rate);
+}
+
+static std::vector<int> parseDelays(const std::string& list) {
+    std::vector<int> delays;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) delays.push_back(std::stoi(item));
+    }
+    return delays;
 }
 
 class AudioStreamer {
 public:
-    AudioStreamer() {
+    // The websocket runs on the runtime's loop alongside the capture. Its
+    // callbacks are reposted onto the runtime's strand, where the chunk path
+    // runs, so the stream state is only ever touched from there.
+    AudioStreamer(AsyncRuntime& runtime, const TranscriptPipeline::Config& transcriptConfig,
+                  const UplinkController::Config& uplinkConfig)
+        : transcripts(transcriptConfig), uplink(uplinkConfig), strand(runtime.strand()),
+          connectSlot(runtime.strand()) {
         // Generate client ID
         clientId = generateClientId();
         
@@ -85,7 +237,7 @@ public:
         client.clear_access_channels(websocketpp::log::alevel::all);
         client.clear_error_channels(websocketpp::log::elevel::all);
         
-        client.init_asio();
+        client.init_asio(&runtime.context());
         
         // Configure TLS
         client.set_tls_init_handler([](websocketpp::connection_hdl) {
@@ -100,33 +252,56 @@ public:
         
         // Register handlers
         client.set_message_handler([this](ConnectionHdl hdl, Client::message_ptr msg) {
-            handleServerMessage(msg->get_payload());
+            boost::asio::post(strand, [this, msg]() { handleServerMessage(msg->get_payload()); });
+        });
+        
+        // Pings carry their send time, so a late pong still yields a round trip
+        client.set_pong_handler([this](ConnectionHdl hdl, std::string payload) {
+            const double rttMs = sinceNs(payload) / 1e6;
+            boost::asio::post(strand, [this, rttMs]() { uplink.onRtt(rttMs); });
+        });
+        client.set_pong_timeout_handler([this](ConnectionHdl hdl, std::string payload) {
+            const double rttMs = sinceNs(payload) / 1e6;
+            boost::asio::post(strand, [this, rttMs]() {
+                Metrics::instance().add("uplink.pong_timeouts");
+                uplink.onRtt(rttMs);
+            });
         });
         
         client.set_open_handler([this](ConnectionHdl hdl) {
-            std::cout << "WebSocket connection established" << std::endl;
-            connected = true;
-            connectionFailed = false;
-            
-            // Send initial configuration
-            sendConfig();
+            boost::asio::post(strand, [this]() {
+                std::cout << "WebSocket connection established" << std::endl;
+                connected = true;
+                uplink.reset();
+                
+                // Send initial configuration; the offered layout stands until acked
+                acceptedChannels = perChannel ? captureChannels : 1;
+                sendConfig();
+                connectSlot.complete();
+            });
         });
         
         client.set_close_handler([this](ConnectionHdl hdl) {
-            std::cout << "WebSocket connection closed" << std::endl;
-            connected = false;
+            boost::asio::post(strand, [this]() {
+                std::cout << "WebSocket connection closed" << std::endl;
+                connected = false;
+            });
         });
         
         client.set_fail_handler([this](ConnectionHdl hdl) {
-            auto con = client.get_con_from_hdl(hdl);
-            std::cout << "WebSocket connection failed. Error: " 
-                      << con->get_ec().message() << std::endl;
-            connected = false;
-            connectionFailed = true;
+            const std::string reason = client.get_con_from_hdl(hdl)->get_ec().message();
+            boost::asio::post(strand, [this, reason]() {
+                std::cout << "WebSocket connection failed. Error: " << reason << std::endl;
+                connected = false;
+                connectSlot.complete(boost::asio::error::connection_refused);
+            });
         });
     }
     
-    bool tryConnect(const std::string& baseUrl) {
+    // Starts connecting; `handler` runs on the loop once the connection is
+    // open, or with an error if it failed or did not open within a second
+    void asyncConnect(const std::string& baseUrl, CompletionSlot::Handler handler) {
+        connectSlot.arm(std::move(handler), 1s);
         try {
             // Construct the full URL with client ID
             std::string fullUrl = baseUrl + "/api/asr-batch-stream/ws/" + clientId;
@@ -136,33 +311,14 @@ public:
             connection = client.get_connection(fullUrl, ec);
             if (ec) {
                 std::cerr << "Failed to create connection: " << ec.message() << std::endl;
-                return false;
+                connectSlot.complete(boost::asio::error::invalid_argument);
+                return;
             }
             
             client.connect(connection);
-            
-            // Start the ASIO io_service run loop in a separate thread
-            if (!clientThread.joinable()) {
-                clientThread = std::thread([this]() {
-                    try {
-                        client.run();
-                    } catch (const std::exception& e) {
-                        std::cerr << "WebSocket thread error: " << e.what() << std::endl;
-                        connected = false;
-                        connectionFailed = true;
-                    }
-                });
-            }
-            
-            // Wait a bit to see if connection succeeds
-            for (int i = 0; i < 10 && !connected && !connectionFailed; ++i) {
-                std::this_thread::sleep_for(100ms);
-            }
-            
-            return connected;
         } catch (const std::exception& e) {
             std::cerr << "Connection attempt failed: " << e.what() << std::endl;
-            return false;
+            connectSlot.complete(boost::asio::error::connection_refused);
         }
     }
     
@@ -174,13 +330,18 @@ public:
            << "\"type\":\"config\","
            << "\"config\":{"
            << "\"audio_format\":\"pcm16\","
-           << "\"sample_rate\":16000,"
-           << "\"channels\":1,"
+           << "\"sample_rate\":" << (pcm16 ? uplinkRate(uplink.mode(), captureRate) : captureRate) << ","
+           << "\"channels\":" << (perChannel ? captureChannels : 1) << ","
+           << "\"capture_channels\":" << captureChannels << ","
+           << "\"stream_mode\":\"" << (perChannel ? "channels" : "mix") << "\","
            << "\"chunk_size\":1024"
            << "}}";
         
+        auto msg = messagePool.acquire(websocketpp::frame::opcode::text);
+        msg->get_raw_payload() = ss.str();
+        
         websocketpp::lib::error_code ec;
-        client.send(connection, ss.str(), websocketpp::frame::opcode::text, ec);
+        sendMessage(msg, false, ec);
         if (ec) {
             std::cerr << "Failed to send config: " << ec.message() << std::endl;
         } else {
@@ -189,7 +350,40 @@ public:
     }
     
     void handleServerMessage(const std::string& message) {
+        if (clock.handleMessage(message)) return;
+        
+        // Transcripts go through the typed pipeline; its callback reports them
+        if (transcripts.handleMessage(message)) return;
+        
         std::cout << "Received from server: " << message << std::endl;
+        
+        // Channel negotiation: the server may accept fewer streams than offered
+        if (message.find("\"type\":\"config_ack\"") != std::string::npos) {
+            size_t pos = message.find("\"channels\":");
+            if (pos != std::string::npos) {
+                int channels = std::atoi(message.c_str() + pos + 11);
+                if (channels > 0) {
+                    acceptedChannels = channels;
+                    std::cout << "Server accepted " << channels << " channel stream(s)" << std::endl;
+                }
+            }
+        }
+    }
+    
+    // Describes what sendConfig offers: captureChannels microphones at
+    // sampleRate, sent either as separate per-channel streams or as one
+    // beamformed mix. Only PCM16 capture is resampled for the uplink.
+    void setStreamLayout(int channels, bool separateStreams, uint32_t sampleRate, bool isPcm16) {
+        captureChannels = channels;
+        captureRate = sampleRate;
+        pcm16 = isPcm16;
+        perChannel = separateStreams;
+        acceptedChannels = separateStreams ? channels : 1;
+    }
+    
+    // Number of per-channel streams the server agreed to
+    int getAcceptedChannels() const {
+        return acceptedChannels;
     }
     
     void disconnect() {
@@ -202,137 +396,540 @@ public:
         }
         
         connected = false;
-        
-        if (clientThread.joinable()) {
-            try {
-                client.stop();
-                clientThread.join();
-            } catch (...) {
-                // Ignore errors during shutdown
-            }
-        }
     }
     
     bool isConnected() const {
         return connected;
     }
     
-    void sendAudioData(const std::vector<char>& data) {
+    // channel >= 0 tags the message as one stream of a multi-channel capture;
+    // chunk places it on the capture timeline
+    void sendAudioData(const char* data, size_t size, int channel = -1,
+                       const CaptureTimeline::Chunk* chunk = nullptr) {
         if (!connected) {
             throw std::runtime_error("WebSocket not connected");
         }
         
-        // Create a JSON message with base64-encoded audio data
-        std::string base64Data = websocketpp::base64_encode(
-            reinterpret_cast<const unsigned char*>(data.data()), 
-            data.size()
-        );
+        // Serialize the JSON message with base64-encoded audio straight into
+        // a pooled websocketpp message
+        const size_t encodedSize = (size + 2) / 3 * 4;
+        auto msg = messagePool.acquire(websocketpp::frame::opcode::text, encodedSize + 128);
+        std::string& payload = msg->get_raw_payload();
+        payload += "{\"type\":\"audio\",\"data\":\"";
+        appendBase64(payload, reinterpret_cast<const unsigned char*>(data), size);
+        payload += "\",\"timestamp\":\"";
+        appendCurrentTimestamp(payload);
+        payload += "\",\"client_id\":\"";
+        payload += clientId;
+        payload += "\"";
+        if (channel >= 0) {
+            payload += ",\"channel\":";
+            payload += std::to_string(channel);
+        }
+        if (chunk) appendTimeline(payload, *chunk);
+        payload += "}";
         
-        // Create the JSON message with timestamp
-        std::stringstream ss;
-        ss << "{"
-           << "\"type\":\"audio\","
-           << "\"data\":\"" << base64Data << "\","
-           << "\"timestamp\":\"" << getCurrentTimestamp() << "\","
-           << "\"client_id\":\"" << clientId << "\""
-           << "}";
+        websocketpp::lib::error_code ec;
+        sendMessage(msg, true, ec);
+        if (ec) {
+            throw std::runtime_error("Failed to send data: " + ec.message());
+        }
+        transcripts.noteAudioSent();
+    }
+    
+    // Stands in for a chunk the voice gate kept home, so the server can tell
+    // it from frames lost in capture
+    void sendSilence(const CaptureTimeline::Chunk& chunk) {
+        if (!connected) {
+            throw std::runtime_error("WebSocket not connected");
+        }
+        
+        auto msg = messagePool.acquire(websocketpp::frame::opcode::text);
+        std::string& payload = msg->get_raw_payload();
+        payload += "{\"type\":\"silence\",\"timestamp\":\"";
+        appendCurrentTimestamp(payload);
+        payload += "\",\"client_id\":\"";
+        payload += clientId;
+        payload += "\"";
+        appendTimeline(payload, chunk);
+        payload += "}";
         
         websocketpp::lib::error_code ec;
-        client.send(connection, ss.str(), websocketpp::frame::opcode::text, ec);
+        sendMessage(msg, false, ec);
         if (ec) {
             throw std::runtime_error("Failed to send data: " + ec.message());
         }
     }
     
+    // Starts a clock_ping exchange; the pong updates the offset estimate
+    void sendClockPing() {
+        if (!connected) return;
+        auto msg = messagePool.acquire(websocketpp::frame::opcode::text);
+        msg->get_raw_payload() = clock.makePing();
+        websocketpp::lib::error_code ec;
+        sendMessage(msg, false, ec);
+    }
+    
+    ClockSync& getClock() {
+        return clock;
+    }
+    
+    // Samples the send buffer for the uplink controller and pings the server
+    // every pingInterval. Returns true when the uplink mode changed.
+    bool probeUplink() {
+        if (!connected) return false;
+        const auto now = UplinkController::Clock::now();
+        if (now - lastPing >= uplink.getConfig().pingInterval) {
+            lastPing = now;
+            websocketpp::lib::error_code ec;
+            client.ping(connection, std::to_string(steadyNs()), ec);
+        }
+        return uplink.sample(connection->get_buffered_amount(), bytesQueued, now);
+    }
+    
+    UplinkController& getUplink() {
+        return uplink;
+    }
+    
+    // Partial/final transcript results from the server
+    TranscriptPipeline& getTranscripts() {
+        return transcripts;
+    }
+    
     ~AudioStreamer() {
         disconnect();
     }
 
 private:
+    static double sinceNs(const std::string& stamp) {
+        return static_cast<double>(steadyNs() - std::strtoll(stamp.c_str(), nullptr, 10));
+    }
+    
+    // Timeline fields: where the chunk's first frame sits in the capture
+    // (sample_index at sample_rate), its steady_clock time on this device and,
+    // once a clock_pong has arrived, the same instant on the server's clock
+    void appendTimeline(std::string& payload, const CaptureTimeline::Chunk& chunk) {
+        payload += ",\"sample_index\":";
+        payload += std::to_string(chunk.sampleIndex);
+        payload += ",\"frames\":";
+        payload += std::to_string(chunk.frames);
+        payload += ",\"sample_rate\":";
+        payload += std::to_string(chunk.sampleRate);
+        payload += ",\"capture_ns\":";
+        payload += std::to_string(chunk.startNs);
+        if (chunk.gapSamples) {
+            payload += ",\"gap_samples\":";
+            payload += std::to_string(chunk.gapSamples);
+        }
+        if (chunk.driftValid) {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%.2f", chunk.driftPpm);
+            payload += ",\"drift_ppm\":";
+            payload += buf;
+        }
+        double serverMs = 0.0;
+        if (clock.toServerMs(chunk.startNs, serverMs)) {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%.3f", serverMs);
+            payload += ",\"server_time_ms\":";
+            payload += buf;
+        }
+    }
+    
+    // Applies the per-message compression policy and records its cost
+    void sendMessage(const Client::message_ptr& msg, bool isAudio, websocketpp::lib::error_code& ec) {
+        const std::string& payload = msg->get_payload();
+        const bool compress = DeflateSettings::current().shouldCompress(isAudio, payload.size());
+        msg->set_compressed(compress);
+        
+        auto start = DeflateStats::Clock::now();
+        client.send(connection, msg, ec);
+        if (!ec) {
+            deflateStats.record(payload, compress, DeflateStats::Clock::now() - start);
+            bytesQueued += payload.size();
+        }
+    }
+    
     Client client;
     Client::connection_ptr connection;
-    std::thread clientThread;
+    MessagePool<TlsDeflateClientConfig> messagePool;
+    DeflateStats deflateStats{"ws.tx"};
+    TranscriptPipeline transcripts;
+    ClockSync clock;
+    UplinkController uplink;
+    UplinkController::Clock::time_point lastPing;
+    uint64_t bytesQueued = 0;
+    AsyncRuntime::Strand strand;
+    CompletionSlot connectSlot;
     bool connected = false;
-    bool connectionFailed = false;
     std::string clientId;
+    int captureChannels = 1;
+    uint32_t captureRate = 16000;
+    bool pcm16 = true;
+    bool perChannel = false;
+    int acceptedChannels = 1;
+};
+
+// Line-oriented output for transcript events, usually a FIFO read by the
+// conversation side. Writes never block: without a reader the line is dropped.
+class TranscriptSink {
+public:
+    explicit TranscriptSink(std::string path) : path(std::move(path)) {}
+    
+    ~TranscriptSink() {
+        if (fd >= 0) close(fd);
+    }
+    
+    void write(const std::string& line) {
+        if (path.empty()) return;
+        if (fd < 0) {
+            fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        }
+        const std::string out = line + "\n";
+        if (fd < 0 || ::write(fd, out.data(), out.size()) != static_cast<ssize_t>(out.size())) {
+            // Reader gone (EPIPE) or not there yet (ENXIO): reopen next time
+            if (fd >= 0 && errno == EPIPE) {
+                close(fd);
+                fd = -1;
+            }
+            Metrics::instance().add("transcript.sink_dropped");
+        }
+    }
+    
+private:
+    std::string path;
+    int fd = -1;
+};
+
+// Connect, capture and upload as a stackless Asio coroutine. Each wait
+// (connecting, a retry delay, the next chunk from arecord) yields to the
+// event loop instead of holding a thread, and the chunk is processed and sent
+// between waits. Only one operation is outstanding at a time, so the
+// coroutine state lives in this object and its completion handlers simply
+// point back at it.
+class UploadLoop : boost::asio::coroutine {
+public:
+    using Buffer = ObjectPool<std::vector<char>>::Handle;
+    // Called on the loop with each complete chunk
+    using ChunkHandler = std::function<void(std::vector<char>& raw)>;
+    
+    UploadLoop(const AsyncRuntime::Strand& strand, AudioStreamer& streamer, CaptureProcess& capture,
+               ObjectPool<std::vector<char>>& pool, std::string wsUrl, size_t chunkBytes,
+               std::string captureCommand, ChunkHandler onChunk)
+        : timer(strand), streamer(streamer), capture(capture), pool(pool), wsUrl(std::move(wsUrl)),
+          chunkBytes(chunkBytes), captureCommand(std::move(captureCommand)), onChunk(std::move(onChunk)) {}
+    
+    void start() {
+        boost::asio::post(timer.get_executor(), Resume{this});
+    }
+    
+private:
+    struct Resume {
+        UploadLoop* self;
+        void operator()(boost::system::error_code ec = {}, size_t = 0) const {
+            self->step(ec);
+        }
+    };
+    
+    void step(boost::system::error_code ec) {
+        BOOST_ASIO_CORO_REENTER(this) {
+            while (true) {
+                if (!streamer.isConnected()) {
+                    // Nobody to send to: stop capturing rather than let arecord overrun
+                    capture.stop();
+                    std::cout << "Attempting to connect to WebSocket server...\n";
+                    BOOST_ASIO_CORO_YIELD streamer.asyncConnect(wsUrl, Resume{this});
+                    if (ec) {
+                        std::cerr << "Connection failed. Retrying in 5 seconds...\n";
+                        BOOST_ASIO_CORO_YIELD wait(5s);
+                        continue;
+                    }
+                }
+                
+                if (!capture.running()) {
+                    std::cout << "Recording: " << captureCommand << "\n";
+                    if (!capture.start()) {
+                        std::cerr << "Failed to start arecord. Retrying...\n";
+                        BOOST_ASIO_CORO_YIELD wait(1s);
+                        continue;
+                    }
+                }
+                
+                raw = pool.acquire();
+                raw->resize(chunkBytes);
+                BOOST_ASIO_CORO_YIELD capture.asyncRead(raw->data(), chunkBytes, Resume{this});
+                if (ec) {
+                    std::cerr << "arecord stopped. Restarting...\n";
+                    capture.stop();
+                    BOOST_ASIO_CORO_YIELD wait(1s);
+                    continue;
+                }
+                
+                failed = false;
+                try {
+                    onChunk(*raw);
+                } catch (const std::exception& e) {
+                    std::cerr << "Error in main loop: " << e.what() << "\n";
+                    failed = true;
+                }
+                raw.reset();
+                if (failed) {
+                    BOOST_ASIO_CORO_YIELD wait(1s);
+                }
+            }
+        }
+    }
+    
+    void wait(std::chrono::seconds delay) {
+        timer.expires_after(delay);
+        timer.async_wait(Resume{this});
+    }
+    
+    boost::asio::steady_timer timer;
+    AudioStreamer& streamer;
+    CaptureProcess& capture;
+    ObjectPool<std::vector<char>>& pool;
+    std::string wsUrl;
+    size_t chunkBytes;
+    std::string captureCommand;
+    ChunkHandler onChunk;
+    Buffer raw;
+    bool failed = false;
 };
 
 int main(int argc, char** argv) {
     const std::string device = getEnv("ARECORD_DEVICE", "hw:5,0");
-    const std::string duration = "2"; // Fixed 2-second duration
+    const unsigned long chunkMs = std::stoul(getEnv("CHUNK_MS", "2000"));
     const std::string format = getEnv("ARECORD_FORMAT", "S16_LE");
     const std::string rate = getEnv("ARECORD_RATE", "16000");
+    const int channels = std::stoi(getEnv("ARECORD_CHANNELS", "1"));
+    if (channels < 1 || channels > static_cast<int>(DelayAndSumBeamformer::maxChannels)) {
+        std::cerr << "Unsupported ARECORD_CHANNELS " << channels << " (use 1 to "
+                  << DelayAndSumBeamformer::maxChannels << ")\n";
+        return 1;
+    }
+    
+    WavFormat captureFormat;
+    captureFormat.channels = static_cast<uint16_t>(channels);
+    captureFormat.sampleRate = static_cast<uint32_t>(std::stoul(rate));
+    captureFormat.bitsPerSample = bitsForFormat(format);
+    if (captureFormat.bitsPerSample == 0) {
+        std::cerr << "Unsupported ARECORD_FORMAT " << format << " (use S16_LE, S24_3LE or S32_LE)\n";
+        return 1;
+    }
+    const size_t chunkFrames = std::max<size_t>(1, static_cast<size_t>(captureFormat.sampleRate) * chunkMs / 1000);
+    const size_t chunkBytes = chunkFrames * captureFormat.blockAlign();
+    // Arrays are streamed as one beamformed mix unless separate streams are asked for
+    const bool perChannel = channels > 1 && getEnv("CAPTURE_MODE", "mix") == "channels";
     
     // WebSocket endpoint (default to local server)
     const std::string wsUrl = getEnv("WS_URL", "wss://robot-asr.pvi.digital");
     
-    AudioStreamer streamer;
+    // Echo cancellation against whatever speak is playing
+    const bool aecEnabled = getEnv("AEC_ENABLE", "1") == "1";
+    const std::string aecRefDir = getEnv("AEC_REF_DIR", "/tmp/aec_ref");
+    EchoCanceller::Config aecConfig;
+    aecConfig.taps = std::stoul(getEnv("AEC_TAPS", "512"));
+    aecConfig.maxDelay = std::stoul(rate) * std::stoul(getEnv("AEC_MAX_DELAY_MS", "500")) / 1000;
+    EchoCanceller aec(aecConfig);
+    
+    // Microphone array handling
+    DelayAndSumBeamformer::Config beamConfig;
+    beamConfig.channels = static_cast<size_t>(channels);
+    beamConfig.delays = parseDelays(getEnv("BEAM_DELAYS", ""));
+    beamConfig.maxLag = std::stoi(getEnv("BEAM_MAX_LAG", "16"));
+    beamConfig.minCorrelation = std::stof(getEnv("BEAM_MIN_CORR", "0.5"));
+    DelayAndSumBeamformer beamformer(beamConfig);
+    
+    // Sample scratch buffers reused across chunks
+    auto framePool = ObjectPool<std::vector<float>>::create(4);
+    auto pcmPool = ObjectPool<std::vector<int16_t>>::create(2);
+    auto imagePool = ObjectPool<std::vector<char>>::create(2);
+    auto capturePool = ObjectPool<std::vector<char>>::create(2);
+    
+    // Real-time capture: arecord gets RT_PRIORITY/RT_CPUS, this process is
+    // locked in memory once its buffers exist
+    const rt::Settings rtSettings = rt::Settings::fromEnv();
+    if (rtSettings.lockMemory) {
+        framePool->preallocate(4, chunkFrames);
+        pcmPool->preallocate(2, chunkFrames);
+        imagePool->preallocate(2, chunkBytes + 64);
+        capturePool->preallocate(2, chunkBytes);
+        rt::prefaultStack();
+        rt::lockMemory();
+    }
+    
+    // Transcript handling: stable partials and finals go to TRANSCRIPT_SINK
+    TranscriptPipeline::Config transcriptConfig;
+    transcriptConfig.stableMinWords = std::stoul(getEnv("STABLE_PARTIAL_WORDS", "3"));
+    transcriptConfig.stableRepeats = std::stoi(getEnv("STABLE_PARTIAL_REPEATS", "2"));
+    transcriptConfig.stableTime = std::chrono::milliseconds(std::stoi(getEnv("STABLE_PARTIAL_MS", "300")));
+    TranscriptSink transcriptSink(getEnv("TRANSCRIPT_SINK", ""));
+    // A reader closing the FIFO must not kill the uploader
+    std::signal(SIGPIPE, SIG_IGN);
+    
+    // Websocket, capture pipes and timers share one small pool of threads
+    AsyncRuntime runtime;
+    const UplinkController::Config uplinkConfig = UplinkController::Config::fromEnv();
+    AudioStreamer streamer(runtime, transcriptConfig, uplinkConfig);
+    streamer.setStreamLayout(channels, perChannel, captureFormat.sampleRate, captureFormat.isPcm16());
+    streamer.getTranscripts().setCallback([&transcriptSink](const TranscriptEvent& ev) {
+        std::cout << "Transcript [" << ev.kindName() << " " << ev.utteranceId << " +"
+                  << static_cast<int>(ev.sinceLastAudioMs()) << "ms]: " << ev.text << std::endl;
+        if (ev.kind != TranscriptEvent::Kind::Partial) {
+            transcriptSink.write(ev.toJson());
+        }
+    });
     
     std::cout << "Starting audio recording and streaming service\n"
               << "Device: " << device << "\n"
               << "Format: " << format << "\n"
               << "Rate: " << rate << "\n"
-              << "Duration: " << duration << "s\n"
-              << "Server: " << wsUrl << "\n\n";
+              << "Channels: " << channels
+              << (channels > 1 ? (perChannel ? " (per-channel streams)" : " (beamformed mix)") : "") << "\n"
+              << "Chunk: " << chunkMs << " ms (" << chunkFrames << " frames)\n"
+              << "Server: " << wsUrl << "\n"
+              << "Uplink: " << (uplinkConfig.adapt ? "adaptive, target " + std::to_string(uplinkConfig.target.count()) + " ms"
+                                                   : "full quality") << "\n"
+              << "AEC: " << (aecEnabled ? "on (reference dir " + aecRefDir + ")" : "off") << "\n"
+              << "Real-time: " << (rtSettings.priority > 0 ? "SCHED_FIFO " + std::to_string(rtSettings.priority) : "off")
+              << (rtSettings.cpus.empty() ? "" : ", pinned") << (rtSettings.lockMemory ? ", mlock" : "") << "\n\n";
+    
+    // Sample-accurate timeline and server clock offset for every chunk
+    CaptureTimeline::Config timelineConfig;
+    timelineConfig.sampleRate = captureFormat.sampleRate;
+    timelineConfig.gapThreshold = std::chrono::milliseconds(std::stoi(getEnv("CAPTURE_GAP_MS", "100")));
+    CaptureTimeline timeline(timelineConfig);
+    const auto clockInterval = std::chrono::milliseconds(std::stoi(getEnv("CLOCK_SYNC_INTERVAL_MS", "5000")));
+    
+    // Short periods so chunk arrival times track the sample clock closely
+    const std::string periodUs = getEnv("CAPTURE_PERIOD_US", "20000");
+    CaptureProcess capture(runtime,
+                           {"arecord", "-D", device, "-f", format, "-r", rate, "-c", std::to_string(channels),
+                            "-t", "raw", "--period-time=" + periodUs, "--buffer-time=500000"},
+                           rtSettings, chunkBytes * 2);
+    const std::string captureCommand = "arecord -D " + device + " -f " + format + " -r " + rate + " -c " +
+                                       std::to_string(channels) + " -t raw --period-time=" + periodUs;
+    
+    uint64_t chunksSent = 0;
+    auto processChunk = [&](std::vector<char>& raw) {
+        // Frames still in the pipe were captured after this chunk ended
+        const size_t backlogFrames = capture.pendingBytes() / captureFormat.blockAlign();
+        const int64_t completedNs = steadyNs() -
+            static_cast<int64_t>(backlogFrames * 1000000000ull / captureFormat.sampleRate);
+        const CaptureTimeline::Chunk chunk = timeline.onChunk(chunkFrames, completedNs);
+        if (chunk.gapSamples) {
+            std::cerr << "Capture gap: " << chunk.gapSamples * 1000 / captureFormat.sampleRate
+                      << " ms missing before sample " << chunk.sampleIndex << "\n";
+        }
+        // Wall-clock time of the first frame, to line up speak's echo reference
+        const int64_t recStartMs = echo_ref::nowEpochMs() - (completedNs - chunk.startNs) / 1000000;
+    
+        if (streamer.getClock().due(completedNs, clockInterval)) {
+            streamer.sendClockPing();
+        }
     
-    while (true) {
         try {
-            if (!streamer.isConnected()) {
-                std::cout << "Attempting to connect to WebSocket server...\n";
-                if (!streamer.tryConnect(wsUrl)) {
-                    std::cerr << "Connection failed. Retrying in 5 seconds...\n";
-                    std::this_thread::sleep_for(5s);
-                    continue;
-                }
-            }
-            
-            const std::string filename = timestampedFilename();
-            
-            std::ostringstream recCmd;
-            recCmd << "arecord -D " << device
-                   << " -d " << duration
-                   << " -f " << format
-                   << " -r " << rate
-                   << " '" << filename << "'";
+            const WavFormat& fmt = captureFormat;
+            int16_t* samples = fmt.isPcm16() ? reinterpret_cast<int16_t*>(raw.data()) : nullptr;
+            const int streams = perChannel ? std::min(channels, streamer.getAcceptedChannels()) : 1;
+            const UplinkController::Mode& mode = streamer.getUplink().mode();
+            auto image = imagePool->acquire();
+            auto reduced = pcmPool->acquire();
+            size_t sentBytes = 0;
             
-            std::cout << "Recording: " << recCmd.str() << "\n";
-            int recStatus = std::system(recCmd.str().c_str());
-            if (recStatus != 0) {
-                std::cerr << "arecord failed with status " << recStatus << ". Retrying...\n";
-                std::this_thread::sleep_for(1s);
-                continue;
-            }
-            
-            if (!std::filesystem::exists(filename)) {
-                std::cerr << "No output file produced: " << filename << ". Retrying...\n";
-                std::this_thread::sleep_for(1s);
-                continue;
-            }
+            // Timeline of what goes out; half-rate modes count at the halved rate
+            const CaptureTimeline::Chunk sentChunk =
+                atUplinkRate(chunk, fmt.sampleRate, samples ? uplinkRate(mode, fmt.sampleRate) : fmt.sampleRate);
             
-            try {
-                // Read and send the WAV file
-                auto audioData = readWavFile(filename);
-                streamer.sendAudioData(audioData);
-                std::cout << "Sent " << audioData.size() << " bytes of audio data\n";
-                
-                // Clean up the file
-                std::error_code ec;
-                std::filesystem::remove(filename, ec);
-                if (ec) {
-                    std::cerr << "Warning: could not remove file '" << filename << "': " << ec.message() << "\n";
+            // One mono stream in the current uplink mode
+            auto sendMono = [&](const int16_t* pcm, int channel) {
+                WavFormat monoFmt = fmt;
+                monoFmt.channels = 1;
+                reduceForUplink(pcm, chunkFrames, mode, monoFmt, *framePool, *reduced);
+                buildWavImage(monoFmt, reduced->data(), reduced->size() * sizeof(int16_t), *image);
+                streamer.sendAudioData(image->data(), image->size(), channel, &sentChunk);
+                sentBytes += image->size();
+            };
+            auto admit = [&](const int16_t* pcm) {
+                if (admitForUplink(pcm, chunkFrames, fmt.sampleRate, mode, streamer.getUplink(), *framePool)) {
+                    return true;
+                }
+                streamer.sendSilence(sentChunk);
+                std::cout << "Skipped silent chunk at sample " << chunk.sampleIndex << " (uplink " << mode.name << ")\n";
+                return false;
+            };
+        
+            if (fmt.channels <= 1 && !samples) {
+                // Wider than 16 bits: sent as captured
+                buildWavImage(fmt, raw.data(), chunkBytes, *image);
+                streamer.sendAudioData(image->data(), image->size(), -1, &chunk);
+                sentBytes = image->size();
+            } else if (fmt.channels <= 1) {
+                // Mono: process in place and send as one WAV image
+                if (aecEnabled) {
+                    cancelEcho(samples, chunkFrames, fmt.sampleRate, recStartMs, aecRefDir, aec, *framePool);
+                }
+                if (!admit(samples)) return;
+                sendMono(samples, -1);
+            } else if (!samples) {
+                throw std::runtime_error("multi-channel capture requires S16_LE");
+            } else if (streams <= 1) {
+                // Beamform the array down to one stream, then cancel echo on the mix
+                auto mono = pcmPool->acquire();
+                beamformer.process(samples, chunkFrames, *mono);
+                if (aecEnabled) {
+                    cancelEcho(mono->data(), chunkFrames, fmt.sampleRate, recStartMs, aecRefDir, aec, *framePool);
+                }
+                if (!admit(mono->data())) return;
+                sendMono(mono->data(), -1);
+            } else {
+                // One tagged stream per accepted channel; the first decides for all
+                auto mono = pcmPool->acquire();
+                mono->resize(chunkFrames);
+                for (int c = 0; c < streams; ++c) {
+                    const int16_t* src = samples + c;
+                    for (size_t i = 0; i < chunkFrames; ++i) {
+                        (*mono)[i] = src[i * fmt.channels];
+                    }
+                    if (c == 0 && !admit(mono->data())) return;
+                    sendMono(mono->data(), c);
                 }
-            } catch (const std::exception& e) {
-                std::cerr << "Error sending audio data: " << e.what() << "\n";
-                // Keep the file for inspection on error
-                std::cerr << "Keeping file for inspection: " << filename << "\n";
-                // Reset connection on send error
-                streamer.disconnect();
+            }
+            std::cout << "Sent " << sentBytes << " bytes of audio data (" << chunkMs << " ms at sample "
+                      << chunk.sampleIndex << ", " << streams << " stream(s), uplink " << mode.name << ")\n";
+            if (++chunksSent % 30 == 0) {
+                std::cout << "Metrics: " << Metrics::instance().toLine() << "\n";
             }
         } catch (const std::exception& e) {
-            std::cerr << "Error in main loop: " << e.what() << "\n";
-            std::this_thread::sleep_for(1s);
+            std::cerr << "Error sending audio data: " << e.what() << "\n";
+            // Reset connection on send error
+            streamer.disconnect();
         }
-    }
+    };
     
+    // Link measurements between chunks; mode changes apply from the next one
+    boost::asio::steady_timer uplinkTimer(runtime.strand());
+    std::function<void()> scheduleProbe = [&]() {
+        uplinkTimer.expires_after(uplinkConfig.sampleInterval);
+        uplinkTimer.async_wait([&](const boost::system::error_code& ec) {
+            if (ec) return;
+            UplinkController& uplink = streamer.getUplink();
+            if (streamer.probeUplink()) {
+                std::cout << "Uplink mode: " << uplink.mode().name << " (delay " << static_cast<int>(uplink.delayMs())
+                          << " ms, rtt " << static_cast<int>(uplink.rttMs()) << " ms, "
+                          << static_cast<int>(uplink.drainKbps()) << " kbit/s)\n";
+            }
+            scheduleProbe();
+        });
+    };
+    scheduleProbe();
+    
+    UploadLoop loop(runtime.strand(), streamer, capture, *capturePool, wsUrl, chunkBytes, captureCommand,
+                    processChunk);
+    loop.start();
+    runtime.run();
+    
+    capture.stop();
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// Process-wide named counters and gauges. Cheap enough for per-chunk and
+// per-message updates; snapshots are printed periodically and can be sent to
+// the server as a JSON object.
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    // Monotonic counter
+    void add(const std::string& name, double delta = 1.0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        values[name] += delta;
+    }
+
+    // Last-value gauge
+    void set(const std::string& name, double value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        values[name] = value;
+    }
+
+    double get(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = values.find(name);
+        return it == values.end() ? 0.0 : it->second;
+    }
+
+    // {"name":value,...} with keys in sorted order
+    std::string toJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream ss;
+        ss << "{";
+        bool first = true;
+        for (const auto& [name, value] : values) {
+            if (!first) ss << ",";
+            ss << "\"" << name << "\":" << value;
+            first = false;
+        }
+        ss << "}";
+        return ss.str();
+    }
+
+    // One "name=value" line, for stdout / log files
+    std::string toLine() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream ss;
+        for (const auto& [name, value] : values) {
+            ss << name << "=" << value << " ";
+        }
+        return ss.str();
+    }
+
+private:
+    Metrics() = default;
+
+    mutable std::mutex mutex;
+    std::map<std::string, double> values;
+};
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "audio_dsp.hpp"
+#include "metrics.hpp"
+#include "realtime.hpp"
+#include "wav_file.hpp"
+
+// In-process mixer for speak's output.
+//
+// Every stream (TTS, alerts, earcons, background audio) is summed into a
+// float bus with its own gain by dsp::mixInto and converted to PCM16 once
+// per period, saturating. The bus feeds a single long-running `aplay -t raw`,
+// so a new stream starts on the next period instead of waiting for a player
+// process to start and open the device, and streams overlap instead of
+// queueing behind each other. Background streams are ducked while speech or
+// an alert plays. Gain changes and stops are ramped over one period so they
+// do not click.
+//
+//   MIXER_RATE, MIXER_CHANNELS   bus format; other WAV formats are converted
+//   MIXER_DEVICE                 ALSA device for aplay -D (default device if unset)
+//   MIXER_PERIOD_MS              mix period
+//   MIXER_BUFFER_MS              device buffer
+//   MIXER_DUCK_DB                background level while speech plays
+class AudioMixer {
+public:
+    using Clock = std::chrono::steady_clock;
+    using StreamId = uint64_t;
+
+    enum class Role {
+        Speech,         // Ducks background
+        Alert,          // Ducks background
+        Effect,         // Earcons: neither ducks nor is ducked
+        Background,     // Ducked while speech or an alert plays
+    };
+
+    // Called on the mixer thread when a stream ends; false if it was stopped
+    // or the device failed before the end
+    using DoneHandler = std::function<void(bool completed)>;
+
+    struct Config {
+        uint32_t sampleRate = 22050;
+        uint16_t channels = 1;
+        std::string device;
+        std::chrono::milliseconds period{10};
+        std::chrono::milliseconds bufferTime{80};
+        float duckDb = -15.0f;
+        std::chrono::milliseconds duckAttack{60};      // Full duck depth reached in this long
+        std::chrono::milliseconds duckRelease{400};    // ...and released in this long
+        size_t maxStreams = 8;
+
+        static Config fromEnv() {
+            Config c;
+            auto env = [](const char* key) -> std::string {
+                const char* v = std::getenv(key);
+                return v ? v : "";
+            };
+            if (!env("MIXER_RATE").empty()) c.sampleRate = static_cast<uint32_t>(std::stoul(env("MIXER_RATE")));
+            if (!env("MIXER_CHANNELS").empty()) c.channels = static_cast<uint16_t>(std::stoi(env("MIXER_CHANNELS")));
+            c.device = env("MIXER_DEVICE");
+            if (!env("MIXER_PERIOD_MS").empty()) c.period = std::chrono::milliseconds(std::stoi(env("MIXER_PERIOD_MS")));
+            if (!env("MIXER_BUFFER_MS").empty()) {
+                c.bufferTime = std::chrono::milliseconds(std::stoi(env("MIXER_BUFFER_MS")));
+            }
+            if (!env("MIXER_DUCK_DB").empty()) c.duckDb = std::stof(env("MIXER_DUCK_DB"));
+            c.channels = std::clamp<uint16_t>(c.channels, 1, 2);
+            c.period = std::max(c.period, std::chrono::milliseconds(1));
+            return c;
+        }
+    };
+
+    AudioMixer(const Config& cfg, const rt::Settings& rtSettings) : config(cfg), rtSettings(rtSettings) {
+        periodSamples = static_cast<size_t>(config.sampleRate * config.period.count() / 1000) * config.channels;
+        duckGain = std::pow(10.0f, config.duckDb / 20.0f);
+        const float depth = 1.0f - duckGain;
+        attackStep = depth * config.period.count() / std::max<float>(1.0f, config.duckAttack.count());
+        releaseStep = depth * config.period.count() / std::max<float>(1.0f, config.duckRelease.count());
+    }
+
+    ~AudioMixer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) thread.join();
+        closeDevice(true);
+        failAll();
+    }
+
+    AudioMixer(const AudioMixer&) = delete;
+    AudioMixer& operator=(const AudioMixer&) = delete;
+
+    // Opens the device and starts mixing; false if aplay could not be started
+    bool start() {
+        if (thread.joinable()) return true;
+        // A player that dies must show up as EPIPE on the next write rather
+        // than kill speak
+        signal(SIGPIPE, SIG_IGN);
+        if (!openDevice()) return false;
+        thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    const Config& getConfig() const { return config; }
+
+    // Queues a WAV file for mixing; it starts on the next period. Returns 0
+    // (and never calls onDone) if the file is unusable or the mixer is full.
+    StreamId play(const std::string& file, Role role, float gainDb = 0.0f, DoneHandler onDone = nullptr) {
+        std::vector<int16_t> samples;
+        try {
+            WavReader reader(file);
+            if (!convert(reader.view(), samples)) {
+                std::cerr << "❌ Mixer: " << file << " is not PCM16" << std::endl;
+                return 0;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "❌ Mixer: " << e.what() << std::endl;
+            return 0;
+        }
+
+        Stream s;
+        s.role = role;
+        s.gain = std::pow(10.0f, gainDb / 20.0f);
+        s.samples = std::move(samples);
+        s.onDone = std::move(onDone);
+        s.queued = Clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (streams.size() >= config.maxStreams) {
+            Metrics::instance().add("mixer.rejected");
+            return 0;
+        }
+        s.id = ++lastId;
+        streams.push_back(std::move(s));
+        return lastId;
+    }
+
+    // Fades the stream out over the next period; its handler gets false
+    void stop(StreamId id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Stream& s : streams) {
+            if (s.id == id) s.stopping = true;
+        }
+    }
+
+    void stopRole(Role role) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Stream& s : streams) {
+            if (s.role == role) s.stopping = true;
+        }
+    }
+
+    size_t activeCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return streams.size();
+    }
+
+private:
+    struct Stream {
+        StreamId id = 0;
+        Role role = Role::Speech;
+        float gain = 1.0f;
+        float applied = 0.0f;       // Gain at the end of the last period
+        bool started = false;
+        bool stopping = false;
+        std::vector<int16_t> samples;
+        size_t pos = 0;
+        DoneHandler onDone;
+        Clock::time_point queued;
+    };
+
+    using Finished = std::vector<std::pair<DoneHandler, bool>>;
+
+    // Brings a PCM16 clip to the bus format: channels averaged down or
+    // duplicated up, and the rate converted if it differs
+    bool convert(const WavView& view, std::vector<int16_t>& out) {
+        const WavFormat& fmt = view.format();
+        const int16_t* x = view.samples();
+        if (!x || !fmt.isPcm16() || fmt.channels == 0 || fmt.sampleRate == 0) return false;
+        const size_t inCh = fmt.channels;
+        const size_t outCh = config.channels;
+        const size_t frames = view.sampleCount() / inCh;
+
+        if (inCh == outCh && fmt.sampleRate == config.sampleRate) {
+            out.assign(x, x + frames * inCh);
+            return true;
+        }
+        if (fmt.sampleRate != config.sampleRate) {
+            Metrics::instance().add("mixer.resampled");
+            rt::warnOnce(resampleWarned, "Mixer resampling " + std::to_string(fmt.sampleRate) + " Hz to " +
+                                         std::to_string(config.sampleRate) + " Hz; set MIXER_RATE to match the TTS output");
+        }
+
+        std::vector<float> plane(frames);
+        std::vector<float> mixed;
+        for (size_t c = 0; c < outCh; ++c) {
+            for (size_t f = 0; f < frames; ++f) {
+                float v = 0.0f;
+                if (outCh == 1) {
+                    for (size_t k = 0; k < inCh; ++k) v += x[f * inCh + k];
+                    v /= static_cast<float>(inCh);
+                } else {
+                    v = x[f * inCh + c % inCh];
+                }
+                plane[f] = v / 32768.0f;
+            }
+            const std::vector<float> resampled = dsp::resampleLinear(
+                plane.data(), frames, static_cast<int>(fmt.sampleRate), static_cast<int>(config.sampleRate));
+            if (c == 0) mixed.resize(resampled.size() * outCh);
+            for (size_t f = 0; f < resampled.size(); ++f) mixed[f * outCh + c] = resampled[f];
+        }
+        out.resize(mixed.size());
+        dsp::floatToInt16(mixed.data(), out.data(), mixed.size());
+        return true;
+    }
+
+    bool openDevice() {
+        std::vector<std::string> args = {
+            "aplay", "-q", "-t", "raw", "-f", "S16_LE",
+            "-r", std::to_string(config.sampleRate),
+            "-c", std::to_string(config.channels),
+            "--period-time=" + std::to_string(config.period.count() * 1000),
+            "--buffer-time=" + std::to_string(config.bufferTime.count() * 1000),
+        };
+        if (!config.device.empty()) {
+            args.push_back("-D");
+            args.push_back(config.device);
+        }
+        args.push_back("-");
+
+        // aplay gets RT_PRIORITY/RT_CPUS like the per-file player did
+        device = rt::spawn(args, rtSettings, false, true);
+        if (device.pid < 0) {
+            std::cerr << "❌ Failed to start aplay for the mixer" << std::endl;
+            return false;
+        }
+        // Room for two periods, so a write never waits on a full pipe
+        fcntl(device.inFd, F_SETPIPE_SZ, static_cast<int>(2 * periodSamples * sizeof(int16_t)));
+        rt::Process errSide = device;
+        errThread = std::thread([errSide]() mutable { rt::drainStderr(errSide, "playback.xruns"); });
+        std::cout << "🎚️ Mixer open: " << config.sampleRate << " Hz, " << config.channels << " ch" << std::endl;
+        return true;
+    }
+
+    // Closing stdin lets aplay play out its buffer; `now` cuts it short
+    void closeDevice(bool now) {
+        if (device.pid < 0) return;
+        if (device.inFd >= 0) close(device.inFd);
+        if (now) kill(device.pid, SIGTERM);
+        if (errThread.joinable()) errThread.join();
+        while (waitpid(device.pid, nullptr, 0) < 0 && errno == EINTR) {}
+        device = rt::Process();
+    }
+
+    // Bytes written to aplay that it has not read yet
+    size_t queuedBytes() const {
+        int queued = 0;
+        if (ioctl(device.inFd, FIONREAD, &queued) != 0) return 0;
+        return static_cast<size_t>(queued);
+    }
+
+    bool writeAll(const int16_t* data, size_t count) {
+        const char* p = reinterpret_cast<const char*>(data);
+        size_t left = count * sizeof(int16_t);
+        while (left > 0) {
+            const ssize_t n = write(device.inFd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void run() {
+        // This thread now paces the device, so it gets the device's policy
+        if (rtSettings.enabled()) rt::applyTo(0, rtSettings);
+
+        std::vector<float> bus(periodSamples);
+        std::vector<int16_t> out(periodSamples);
+        const size_t periodBytes = periodSamples * sizeof(int16_t);
+        Finished finished;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            // Keep at most a period queued in the pipe; the rest of the
+            // latency is the device buffer
+            lock.unlock();
+            while (queuedBytes() > periodBytes && !stopping) {
+                std::this_thread::sleep_for(config.period / 2);
+            }
+            lock.lock();
+            if (stopping) break;
+
+            std::fill(bus.begin(), bus.end(), 0.0f);
+            mixPeriod(bus, finished);
+            lock.unlock();
+
+            dsp::floatToInt16(bus.data(), out.data(), out.size());
+            for (auto& f : finished) {
+                if (f.first) f.first(f.second);
+            }
+            finished.clear();
+
+            const bool written = writeAll(out.data(), out.size());
+            lock.lock();
+            if (!written && !stopping) {
+                // The player died: whatever was playing is lost, start over
+                lock.unlock();
+                std::cerr << "❌ Mixer output failed, reopening the device" << std::endl;
+                Metrics::instance().add("mixer.device_restarts");
+                closeDevice(true);
+                failAll();
+                lock.lock();
+                while (!stopping) {
+                    if (cv.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping.load(); })) break;
+                    lock.unlock();
+                    const bool opened = openDevice();
+                    if (!opened) failAll();
+                    lock.lock();
+                    if (opened) break;
+                }
+            }
+        }
+    }
+
+    // Sums every stream's next period into `bus`; called with the lock held
+    void mixPeriod(std::vector<float>& bus, Finished& finished) {
+        bool foreground = false;
+        for (const Stream& s : streams) {
+            if (!s.stopping && (s.role == Role::Speech || s.role == Role::Alert)) foreground = true;
+        }
+        const float previousDuck = duck;
+        duck = foreground ? std::max(duckGain, duck - attackStep) : std::min(1.0f, duck + releaseStep);
+        if (duck != previousDuck) Metrics::instance().set("mixer.duck_db", 20.0 * std::log10(duck));
+
+        const auto now = Clock::now();
+        for (Stream& s : streams) {
+            float target = s.stopping ? 0.0f : s.gain;
+            if (s.role == Role::Background) target *= duck;
+            if (!s.started) {
+                s.started = true;
+                s.applied = s.stopping ? 0.0f : target;
+                Metrics::instance().set("mixer.start_ms",
+                    std::chrono::duration<double, std::milli>(now - s.queued).count());
+            }
+            const size_t n = std::min(bus.size(), s.samples.size() - s.pos);
+            dsp::mixInto(s.samples.data() + s.pos, bus.data(), s.applied, target, n);
+            s.applied = target;
+            s.pos += n;
+        }
+
+        auto done = std::stable_partition(streams.begin(), streams.end(), [](const Stream& s) {
+            return !s.stopping && s.pos < s.samples.size();
+        });
+        for (auto it = done; it != streams.end(); ++it) {
+            finished.emplace_back(std::move(it->onDone), !it->stopping);
+        }
+        streams.erase(done, streams.end());
+        Metrics::instance().set("mixer.streams", static_cast<double>(streams.size()));
+    }
+
+    // Ends every stream unfinished, e.g. when the device went away
+    void failAll() {
+        std::vector<Stream> failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed.swap(streams);
+        }
+        for (Stream& s : failed) {
+            if (s.onDone) s.onDone(false);
+        }
+    }
+
+    Config config;
+    rt::Settings rtSettings;
+    size_t periodSamples = 0;
+    float duckGain = 1.0f;
+    float attackStep = 1.0f;
+    float releaseStep = 1.0f;
+    float duck = 1.0f;              // Current background gain, mixer thread only
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Stream> streams;
+    StreamId lastId = 0;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> resampleWarned{false};
+
+    rt::Process device;
+    std::thread errThread;
+    std::thread thread;
+};
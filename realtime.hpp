@@ -0,0 +1,279 @@
+#pragma once
+
+#include <alloca.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Real-time settings for the audio device processes (arecord in
+// audio_uploader, the player in speak).
+//
+// Capture and playback run in child processes, so the scheduling policy and
+// CPU affinity are applied to those children, before they exec, rather than
+// to our own threads: the websocket/TLS thread and logging keep the default
+// policy. Memory locking applies to the calling process. Everything falls
+// back to the default behaviour with a one-time warning when the kernel
+// refuses (no CAP_SYS_NICE / CAP_IPC_LOCK, RLIMIT_RTPRIO or RLIMIT_MEMLOCK
+// too low).
+//
+//   RT_PRIORITY   SCHED_FIFO priority 1..99 for the device process (0 = off)
+//   RT_CPUS       CPUs to pin it to, e.g. "3" or "2-3,5"
+//   RT_MLOCK      1 = lock this process's memory after start-up
+namespace rt {
+
+struct Settings {
+    int priority = 0;
+    std::vector<int> cpus;
+    bool lockMemory = false;
+
+    bool enabled() const { return priority > 0 || !cpus.empty(); }
+
+    static std::vector<int> parseCpus(const std::string& spec) {
+        std::vector<int> cpus;
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (item.empty()) continue;
+            const size_t dash = item.find('-');
+            try {
+                const int first = std::stoi(item.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int c = first; c <= last && c < CPU_SETSIZE; ++c) {
+                    if (c >= 0) cpus.push_back(c);
+                }
+            } catch (const std::exception&) {
+                std::cerr << "Ignoring invalid RT_CPUS entry: " << item << std::endl;
+            }
+        }
+        return cpus;
+    }
+
+    static Settings fromEnv() {
+        Settings s;
+        if (const char* v = std::getenv("RT_PRIORITY")) s.priority = std::atoi(v);
+        if (const char* v = std::getenv("RT_CPUS")) s.cpus = parseCpus(v);
+        if (const char* v = std::getenv("RT_MLOCK")) s.lockMemory = std::string(v) == "1";
+        const int maxPriority = sched_get_priority_max(SCHED_FIFO);
+        if (s.priority > maxPriority) s.priority = maxPriority;
+        return s;
+    }
+};
+
+// Prints a warning the first time each kind of fallback happens
+inline void warnOnce(std::atomic<bool>& flag, const std::string& message) {
+    if (!flag.exchange(true)) std::cerr << "⚠️ " << message << std::endl;
+}
+
+// errno of each setting the kernel refused, 0 where it was applied or not
+// asked for
+struct Refusals {
+    int sched = 0;
+    int affinity = 0;
+};
+
+// The settings in the form the system calls take, built before a fork so the
+// child only has to make the calls
+struct Prepared {
+    bool fifo = false;
+    sched_param param{};
+    bool pin = false;
+    cpu_set_t cpus;
+
+    explicit Prepared(const Settings& s) : fifo(s.priority > 0), pin(!s.cpus.empty()) {
+        param.sched_priority = s.priority;
+        CPU_ZERO(&cpus);
+        for (int c : s.cpus) CPU_SET(c, &cpus);
+    }
+
+    // Only system calls, so it is safe between fork and exec
+    Refusals applyTo(pid_t pid) const {
+        Refusals r;
+        // Children of the device process (if any) go back to normal
+        if (fifo && sched_setscheduler(pid, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0) r.sched = errno;
+        if (pin && sched_setaffinity(pid, sizeof(cpus), &cpus) != 0) r.affinity = errno;
+        return r;
+    }
+};
+
+// Counts and warns about refused settings. Returns false if there were any.
+inline bool report(const Refusals& r) {
+    static std::atomic<bool> schedWarned{false};
+    static std::atomic<bool> affinityWarned{false};
+    if (r.sched) {
+        Metrics::instance().add("rt.sched_fallbacks");
+        warnOnce(schedWarned, std::string("SCHED_FIFO not permitted (") + std::strerror(r.sched) +
+                              "), audio runs at normal priority");
+    }
+    if (r.affinity) {
+        Metrics::instance().add("rt.affinity_fallbacks");
+        warnOnce(affinityWarned, std::string("CPU pinning failed (") + std::strerror(r.affinity) +
+                                 "), audio may run on any CPU");
+    }
+    return !r.sched && !r.affinity;
+}
+
+// Applies the policy and affinity to `pid` (0 = calling thread). Returns
+// false if anything was refused; the process keeps running either way.
+inline bool applyTo(pid_t pid, const Settings& s) {
+    return report(Prepared(s).applyTo(pid));
+}
+
+// Locks what is mapped now, and everything mapped later when the limit
+// allows it. Without an unlimited RLIMIT_MEMLOCK, MCL_FUTURE would turn
+// ordinary allocations into failures once the limit is reached, so only the
+// current (pre-faulted) pages are locked in that case.
+inline bool lockMemory() {
+    static std::atomic<bool> warned{false};
+    rlimit limit{};
+    const bool unlimited = geteuid() == 0 ||
+                           (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY);
+    const int flags = unlimited ? (MCL_CURRENT | MCL_FUTURE) : MCL_CURRENT;
+    if (mlockall(flags) != 0) {
+        Metrics::instance().add("rt.mlock_fallbacks");
+        warnOnce(warned, std::string("mlockall failed (") + std::strerror(errno) + "), memory may be paged out");
+        return false;
+    }
+    Metrics::instance().set("rt.mlocked", 1);
+    return true;
+}
+
+// Touches `bytes` of stack so later calls do not fault it in mid-chunk
+inline void prefaultStack(size_t bytes = 256 * 1024) {
+    volatile char* buf = static_cast<volatile char*>(alloca(bytes));
+    for (size_t i = 0; i < bytes; i += 4096) buf[i] = 0;
+}
+
+// ALSA tools report xruns on stderr ("overrun!!!", "underrun!!!")
+inline bool isXrunLine(const std::string& line) {
+    return line.find("overrun") != std::string::npos || line.find("underrun") != std::string::npos ||
+           line.find("xrun") != std::string::npos;
+}
+
+// A device process whose stderr (and optionally stdout) is read by the
+// parent, and whose stdin is optionally written by it
+struct Process {
+    pid_t pid = -1;
+    int errFd = -1;
+    int outFd = -1;
+    int inFd = -1;
+};
+
+// Starts argv[0] (looked up in PATH) with stderr on a pipe. The settings are
+// applied by the child itself between fork and exec, so the program runs
+// with them from its first instruction; the child reports what was refused
+// over a close-on-exec pipe. With pipeStdout, its stdout is on outFd too (a
+// capture streaming to "-"); with pipeStdin, inFd feeds its stdin (a player
+// reading "-"). pid is -1 on failure.
+inline Process spawn(const std::vector<std::string>& args, const Settings& s, bool pipeStdout = false,
+                     bool pipeStdin = false) {
+    Process proc;
+    int errPipe[2];
+    int outPipe[2] = {-1, -1};
+    int inPipe[2] = {-1, -1};
+    int reportPipe[2] = {-1, -1};
+    if (args.empty() || pipe2(errPipe, O_CLOEXEC) != 0) return proc;
+    if ((pipeStdout && pipe2(outPipe, O_CLOEXEC) != 0) || (pipeStdin && pipe2(inPipe, O_CLOEXEC) != 0) ||
+        (s.enabled() && pipe2(reportPipe, O_CLOEXEC) != 0)) {
+        for (int fd : {errPipe[0], errPipe[1], outPipe[0], outPipe[1], inPipe[0], inPipe[1]}) {
+            if (fd >= 0) close(fd);
+        }
+        return proc;
+    }
+
+    std::vector<char*> argv;
+    for (const std::string& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    const Prepared prepared(s);
+
+    proc.pid = fork();
+    if (proc.pid == 0) {
+        if (reportPipe[1] >= 0) {
+            const Refusals refused = prepared.applyTo(0);
+            ssize_t ignored = write(reportPipe[1], &refused, sizeof(refused));
+            (void)ignored;
+        }
+        dup2(errPipe[1], STDERR_FILENO);
+        if (pipeStdout) dup2(outPipe[1], STDOUT_FILENO);
+        if (pipeStdin) dup2(inPipe[0], STDIN_FILENO);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(errPipe[1]);
+    if (pipeStdout) close(outPipe[1]);
+    if (pipeStdin) close(inPipe[0]);
+    if (reportPipe[1] >= 0) close(reportPipe[1]);
+    if (proc.pid < 0) {
+        close(errPipe[0]);
+        if (pipeStdout) close(outPipe[0]);
+        if (pipeStdin) close(inPipe[1]);
+        if (reportPipe[0] >= 0) close(reportPipe[0]);
+        return proc;
+    }
+    proc.errFd = errPipe[0];
+    proc.outFd = outPipe[0];
+    proc.inFd = inPipe[1];
+    if (reportPipe[0] >= 0) {
+        Refusals refused;
+        ssize_t n;
+        while ((n = read(reportPipe[0], &refused, sizeof(refused))) < 0 && errno == EINTR) {}
+        if (n == static_cast<ssize_t>(sizeof(refused))) report(refused);
+        close(reportPipe[0]);
+    }
+    return proc;
+}
+
+// Reads the child's stderr until it exits, forwarding it to ours and
+// counting xruns under `metric`. Closes the fd.
+inline size_t drainStderr(Process& proc, const std::string& metric) {
+    size_t xruns = 0;
+    std::string pending;
+    char chunk[512];
+    for (;;) {
+        ssize_t n = read(proc.errFd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(chunk, static_cast<size_t>(n));
+        size_t nl;
+        while ((nl = pending.find('\n')) != std::string::npos) {
+            const std::string line = pending.substr(0, nl);
+            pending.erase(0, nl + 1);
+            std::cerr << line << "\n";
+            if (isXrunLine(line)) ++xruns;
+        }
+    }
+    if (!pending.empty()) {
+        std::cerr << pending << "\n";
+        if (isXrunLine(pending)) ++xruns;
+    }
+    close(proc.errFd);
+    proc.errFd = -1;
+    if (xruns) Metrics::instance().add(metric, static_cast<double>(xruns));
+    return xruns;
+}
+
+// spawn + drainStderr + waitpid; returns the exit status like std::system
+inline int run(const std::vector<std::string>& args, const Settings& s, const std::string& xrunMetric) {
+    Process proc = spawn(args, s);
+    if (proc.pid < 0) return -1;
+    drainStderr(proc, xrunMetric);
+    int status = 0;
+    while (waitpid(proc.pid, &status, 0) < 0 && errno == EINTR) {}
+    return status;
+}
+
+} // namespace rt
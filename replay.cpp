@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+#include "speak_client.hpp"
+
+// Replays recorded websocket_log_*.txt sessions through the speak message
+// path (WebSocketClient::handleServerMessage) and reports per-stage latency.
+//
+//   replay [options] websocket_log_*.txt
+//     --speed X      time-scale the recorded gaps (2 = twice as fast)
+//     --max          no gaps: measures raw throughput of the speak path
+//     --loop N       replay the logs N times
+//     --play         actually play audio (default: skip the player)
+//     --csv FILE     per-event timings
+//     --script FILE  write the frames as an audio_server STUB_SCRIPT instead,
+//                    to replay them over a real socket
+//
+// Navigation events still fetch audio from TTS_URL; point it at a local
+// audio_server for repeatable numbers. Log timestamps have one second
+// resolution, so frames logged within the same second arrive back to back.
+
+using Clock = std::chrono::steady_clock;
+
+struct Frame {
+    int64_t offsetMs = 0;   // Since the first frame of its log
+    std::string event;
+    std::string payload;
+};
+
+struct EventTiming {
+    std::string event;
+    Clock::time_point scheduled;
+    std::map<std::string, Clock::time_point> stages;
+};
+
+// "42/tts,["name",{...}]" -> name; bare Engine.IO packets get a label
+static std::string eventName(const std::string& frame) {
+    if (frame.rfind("42", 0) == 0) {
+        size_t open = frame.find("[\"");
+        if (open != std::string::npos) {
+            size_t close = frame.find('"', open + 2);
+            if (close != std::string::npos) return frame.substr(open + 2, close - open - 2);
+        }
+        return "event";
+    }
+    if (frame.rfind("40", 0) == 0) return "namespace_connect";
+    if (frame.rfind("0", 0) == 0) return "open";
+    if (frame.rfind("2", 0) == 0) return "ping";
+    return "other";
+}
+
+static bool loadLog(const std::string& path, std::vector<Frame>& frames) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "❌ Failed to open log: " << path << std::endl;
+        return false;
+    }
+
+    static const std::string marker = "] SERVER: ";
+    std::string line;
+    std::time_t first = -1;
+    while (std::getline(file, line)) {
+        size_t pos = line.find(marker);
+        if (line.empty() || line[0] != '[' || pos == std::string::npos) continue;
+
+        std::tm tm{};
+        std::istringstream ts(line.substr(1, pos - 1));
+        ts >> std::get_time(&tm, "%Y-%m-%d %H:%M:%S");
+        if (ts.fail()) continue;
+        tm.tm_isdst = -1;
+        const std::time_t t = std::mktime(&tm);
+        if (first < 0) first = t;
+
+        Frame frame;
+        frame.offsetMs = static_cast<int64_t>(t - first) * 1000;
+        frame.payload = line.substr(pos + marker.size());
+        frame.event = eventName(frame.payload);
+        frames.push_back(std::move(frame));
+    }
+    return true;
+}
+
+// STUB_SCRIPT lines: "<delay_ms> <event> <json>"
+static bool writeScript(const std::vector<Frame>& frames, const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "❌ Failed to open script: " << path << std::endl;
+        return false;
+    }
+    out << "# generated by replay\n";
+    int64_t last = 0;
+    size_t written = 0;
+    for (const Frame& f : frames) {
+        // 42/tts,["name",{...}] -> {...}; the stub adds the handshake itself
+        if (f.payload.rfind("42/tts,[", 0) != 0 || f.payload.back() != ']') continue;
+        const size_t nameEnd = f.payload.find("\",", 8);
+        if (nameEnd == std::string::npos) continue;
+        const std::string data = f.payload.substr(nameEnd + 2, f.payload.size() - nameEnd - 3);
+        out << std::max<int64_t>(0, f.offsetMs - last) << " " << f.event << " " << data << "\n";
+        last = f.offsetMs;
+        ++written;
+    }
+    std::cout << "📝 Wrote " << written << " events to " << path << std::endl;
+    return true;
+}
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const size_t idx = static_cast<size_t>(p * (v.size() - 1) + 0.5);
+    return v[std::min(idx, v.size() - 1)];
+}
+
+static double msBetween(Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+int main(int argc, char** argv) {
+    double speed = 1.0;
+    bool maxSpeed = false;
+    bool play = false;
+    int loops = 1;
+    std::string csvPath;
+    std::string scriptPath;
+    std::vector<std::string> logs;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            speed = std::stod(argv[++i]);
+        } else if (arg == "--max") {
+            maxSpeed = true;
+        } else if (arg == "--play") {
+            play = true;
+        } else if (arg == "--loop" && i + 1 < argc) {
+            loops = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--csv" && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (arg == "--script" && i + 1 < argc) {
+            scriptPath = argv[++i];
+        } else {
+            logs.push_back(arg);
+        }
+    }
+    if (logs.empty() || speed <= 0.0) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--speed X | --max] [--loop N] [--play] [--csv FILE] [--script FILE] websocket_log_*.txt\n";
+        return 1;
+    }
+
+    // Logs are replayed back to back, each starting where the previous ended
+    std::vector<Frame> frames;
+    for (const std::string& path : logs) {
+        std::vector<Frame> logFrames;
+        if (!loadLog(path, logFrames)) return 1;
+        const int64_t base = frames.empty() ? 0 : frames.back().offsetMs + 1000;
+        for (Frame& f : logFrames) {
+            f.offsetMs += base;
+            frames.push_back(std::move(f));
+        }
+    }
+    std::cout << "📂 Loaded " << frames.size() << " frames from " << logs.size() << " log(s)\n";
+    if (frames.empty()) return 1;
+
+    if (!scriptPath.empty()) {
+        return writeScript(frames, scriptPath) ? 0 : 1;
+    }
+
+    WebSocketClient wsClient(false);
+    wsClient.tts().setPlaybackEnabled(play);
+
+    // Spoken messages finish on the utterance scheduler's thread; stages are
+    // matched to events by the client's per-message sequence number
+    std::vector<EventTiming> timings;
+    timings.reserve(frames.size() * loops);
+    std::mutex timingsMutex;
+    wsClient.setStageHandler([&timings, &timingsMutex](const char* stage, uint64_t seq) {
+        const auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(timingsMutex);
+        if (seq >= 1 && seq <= timings.size()) timings[seq - 1].stages.emplace(stage, now);
+    });
+
+    // One thread, like the websocketpp io thread: while a message is being
+    // handled the following ones wait, and that wait is the queueing time
+    const Clock::time_point start = Clock::now();
+    Clock::time_point loopStart = start;
+    const int64_t span = frames.back().offsetMs + 1000;
+    for (int loop = 0; loop < loops; ++loop) {
+        for (const Frame& frame : frames) {
+            EventTiming timing;
+            timing.event = frame.event;
+            if (maxSpeed) {
+                timing.scheduled = Clock::now();
+            } else {
+                timing.scheduled = loopStart + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double, std::milli>(frame.offsetMs / speed));
+                std::this_thread::sleep_until(timing.scheduled);
+            }
+            {
+                std::lock_guard<std::mutex> lock(timingsMutex);
+                timings.push_back(std::move(timing));
+            }
+            wsClient.handleServerMessage(frame.payload);
+        }
+        loopStart = maxSpeed ? Clock::now()
+                             : loopStart + std::chrono::duration_cast<Clock::duration>(
+                                   std::chrono::duration<double, std::milli>(span / speed));
+    }
+    wsClient.waitIdle();
+    const double wallMs = msBetween(start, Clock::now());
+
+    // Per-event CSV
+    if (!csvPath.empty()) {
+        std::ofstream csv(csvPath);
+        csv << "index,event,queue_ms,decode_ms,synth_ms,playback_start_ms\n";
+        for (size_t i = 0; i < timings.size(); ++i) {
+            const EventTiming& t = timings[i];
+            auto stageMs = [&t](const char* from, const char* to) -> std::string {
+                auto a = from ? t.stages.find(from) : t.stages.end();
+                auto b = t.stages.find(to);
+                if (b == t.stages.end()) return "";
+                return std::to_string(msBetween(from ? a->second : t.scheduled, b->second));
+            };
+            csv << i << "," << t.event << "," << stageMs(nullptr, "received") << ","
+                << stageMs("received", "decoded") << "," << stageMs("queued", "synthesized") << ","
+                << stageMs(nullptr, "playback_start") << "\n";
+        }
+    }
+
+    // Summary per event type
+    struct Series { std::vector<double> queue, decode, synth, playback; };
+    std::map<std::string, Series> byEvent;
+    for (const EventTiming& t : timings) {
+        Series& s = byEvent[t.event];
+        auto received = t.stages.find("received");
+        auto decoded = t.stages.find("decoded");
+        auto queued = t.stages.find("queued");
+        auto synthesized = t.stages.find("synthesized");
+        auto playback = t.stages.find("playback_start");
+        if (received != t.stages.end()) {
+            s.queue.push_back(msBetween(t.scheduled, received->second));
+            if (decoded != t.stages.end()) s.decode.push_back(msBetween(received->second, decoded->second));
+        }
+        if (queued != t.stages.end() && synthesized != t.stages.end()) {
+            s.synth.push_back(msBetween(queued->second, synthesized->second));
+        }
+        if (playback != t.stages.end()) s.playback.push_back(msBetween(t.scheduled, playback->second));
+    }
+
+    auto cell = [](const std::vector<double>& v) {
+        std::ostringstream ss;
+        if (v.empty()) {
+            ss << std::setw(20) << "-";
+        } else {
+            ss << std::fixed << std::setprecision(2) << std::setw(9) << percentile(v, 0.5)
+               << " /" << std::setw(9) << percentile(v, 0.95);
+        }
+        return ss.str();
+    };
+
+    std::cout << "\n📊 Replay: " << timings.size() << " events in " << std::fixed << std::setprecision(1)
+              << wallMs << " ms (" << (timings.size() * 1000.0 / std::max(wallMs, 1e-3)) << " events/s)\n"
+              << "   latencies in ms, p50 / p95; playback start is measured from the scheduled arrival\n\n"
+              << std::left << std::setw(18) << "event" << std::right << std::setw(7) << "count"
+              << std::setw(21) << "queue" << std::setw(21) << "decode"
+              << std::setw(21) << "synthesis" << std::setw(21) << "playback start" << "\n";
+    for (const auto& [event, s] : byEvent) {
+        const size_t count = std::count_if(timings.begin(), timings.end(),
+                                           [&event](const EventTiming& t) { return t.event == event; });
+        std::cout << std::left << std::setw(18) << event << std::right << std::setw(7) << count
+                  << " " << cell(s.queue) << " " << cell(s.decode)
+                  << " " << cell(s.synth) << " " << cell(s.playback) << "\n";
+    }
+    std::cout << "\n📊 Metrics: " << Metrics::instance().toLine() << "\n";
+
+    return 0;
+}
@@ -1,87 +1,791 @@
 #include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/config/asio.hpp>
 #include <websocketpp/server.hpp>
+#include <websocketpp/base64/base64.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <ctime>
+#include <cstdlib>
 #include <filesystem>
 #include <chrono>
-#include <set>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "asr_batch.hpp"
+#include "json_util.hpp"
+#include "metrics.hpp"
+#include "shm_ring.hpp"
+#include "wav_file.hpp"
+
+// Local stand-in for the robot backends.
+//
+//  - /socket.io/?EIO=4&transport=websocket  Engine.IO v4 / Socket.IO /tts
+//    namespace as used by speak (handshake, ping/pong, events)
+//  - /api/asr-batch-stream/ws/<id>          audio_uploader JSON audio stream
+//  - any other WebSocket path               raw binary uploads (recorder)
+//
+// Audio from all connections is batched for the ASR worker (ASR_WORKER
+// command over a pipe, or the file writer by default) and each result is
+// sent back to the connection its chunk came from. With SHM_RING set, PCM
+// goes to a shared-memory ring for a co-located consumer instead.
+//  - POST /api/tts/stream                   WAV from local fixtures
+//  - POST /api/emit/<event>                 broadcast an event to /tts clients
+//  - POST /api/sentences                    sentence_start/sentence_audio run
+//
+// Every outgoing frame and HTTP response goes through the link model, which
+// adds latency, jitter and a bandwidth cap, and can drop connections.
 
-using Server = websocketpp::server<websocketpp::config::asio>;
 using ConnectionHdl = websocketpp::connection_hdl;
-using Message = Server::message_ptr;
+using namespace std::chrono_literals;
+
+static std::string getEnv(const char* key, const std::string& def = "") {
+    const char* v = std::getenv(key);
+    return v ? std::string(v) : def;
+}
+
+// Simulated network conditions, from STUB_* environment variables
+struct LinkConditions {
+    int latencyMs = 0;              // STUB_LATENCY_MS: one-way delay
+    int jitterMs = 0;               // STUB_JITTER_MS: extra uniform 0..jitter delay
+    double bandwidthKbps = 0;       // STUB_BANDWIDTH_KBPS: 0 = unlimited
+    double disconnectProb = 0;      // STUB_DISCONNECT_PROB: per outgoing frame
+    int disconnectAfterMs = 0;      // STUB_DISCONNECT_AFTER_MS: 0 = never
+    int synthMs = 200;              // STUB_SYNTH_MS: per-sentence TTS compute time
+
+    static LinkConditions fromEnv() {
+        LinkConditions c;
+        c.latencyMs = std::stoi(getEnv("STUB_LATENCY_MS", "0"));
+        c.jitterMs = std::stoi(getEnv("STUB_JITTER_MS", "0"));
+        c.bandwidthKbps = std::stod(getEnv("STUB_BANDWIDTH_KBPS", "0"));
+        c.disconnectProb = std::stod(getEnv("STUB_DISCONNECT_PROB", "0"));
+        c.disconnectAfterMs = std::stoi(getEnv("STUB_DISCONNECT_AFTER_MS", "0"));
+        c.synthMs = std::stoi(getEnv("STUB_SYNTH_MS", "200"));
+        return c;
+    }
+};
 
+template <typename Config>
 class AudioServer {
 public:
-    AudioServer() {
+    using Server = websocketpp::server<Config>;
+    using Message = typename Server::message_ptr;
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr bool secure = std::is_same<Config, websocketpp::config::asio_tls>::value;
+
+    AudioServer() : link(LinkConditions::fromEnv()), rng(std::random_device{}()) {
         // Set up server
         server.set_access_channels(websocketpp::log::alevel::none);
         server.set_error_channels(websocketpp::log::elevel::fatal);
-        
+
         server.init_asio();
-        
+        server.set_reuse_addr(true);
+
+        if constexpr (secure) {
+            const std::string cert = getEnv("TLS_CERT");
+            const std::string key = getEnv("TLS_KEY");
+            server.set_tls_init_handler([cert, key](ConnectionHdl) {
+                namespace ssl = boost::asio::ssl;
+                auto ctx = std::make_shared<ssl::context>(ssl::context::sslv23);
+                ctx->set_options(ssl::context::default_workarounds |
+                                 ssl::context::no_sslv2 |
+                                 ssl::context::no_sslv3 |
+                                 ssl::context::single_dh_use);
+                ctx->use_certificate_chain_file(cert);
+                ctx->use_private_key_file(key, ssl::context::pem);
+                return ctx;
+            });
+        }
+
         // Register handlers
         server.set_message_handler([this](ConnectionHdl hdl, Message msg) {
             handle_message(hdl, msg);
         });
-        
+
         server.set_open_handler([this](ConnectionHdl hdl) {
-            std::cout << "Client connected\n";
-            connections.insert(hdl);
+            handle_open(hdl);
         });
-        
+
         server.set_close_handler([this](ConnectionHdl hdl) {
             std::cout << "Client disconnected\n";
-            connections.erase(hdl);
+            auto it = sessions.find(hdl);
+            if (it != sessions.end()) {
+                if (ring) {
+                    shm_ring::RecordInfo end;
+                    end.kind = shm_ring::SessionEnd;
+                    end.session = it->second.id;
+                    ring->publish(end, nullptr, 0);
+                }
+                sessionIds.erase(it->second.id);
+                sessions.erase(it);
+            }
         });
 
-        // Ensure output directory exists
-        std::filesystem::create_directories("output_test");
+        server.set_http_handler([this](ConnectionHdl hdl) {
+            handle_http(hdl);
+        });
+
+        pingIntervalMs = std::stoi(getEnv("STUB_PING_INTERVAL_MS", "25000"));
+        pingTimeoutMs = std::stoi(getEnv("STUB_PING_TIMEOUT_MS", "20000"));
+        load_fixtures(getEnv("TTS_FIXTURES", "3.wav"));
+        load_script(getEnv("STUB_SCRIPT", ""));
+
+        // ASR batching: ASR_WORKER runs a local process, otherwise chunks are
+        // written to output_test/ as before
+        BatchScheduler::Config batchConfig;
+        batchConfig.maxBatch = std::stoul(getEnv("ASR_MAX_BATCH", "8"));
+        batchConfig.maxWait = std::chrono::milliseconds(std::stoi(getEnv("ASR_MAX_WAIT_MS", "50")));
+        batchConfig.maxQueue = std::stoul(getEnv("ASR_MAX_QUEUE", "256"));
+        const std::string workerCommand = getEnv("ASR_WORKER", "");
+        std::unique_ptr<AsrWorker> worker;
+        if (workerCommand.empty()) {
+            worker = std::make_unique<FileWorker>("output_test", rawFormat);
+        } else {
+            const std::chrono::milliseconds workerTimeout(std::stoi(getEnv("ASR_WORKER_TIMEOUT_MS", "10000")));
+            worker = std::make_unique<PipeWorker>(workerCommand, workerTimeout);
+        }
+        std::cout << "ASR worker: " << worker->name() << " (batch " << batchConfig.maxBatch
+                  << ", wait " << batchConfig.maxWait.count() << "ms)\n";
+        // SHM_RING=/name: publish PCM to a shared-memory ring (SHM_RING_MB)
+        const std::string ringName = getEnv("SHM_RING", "");
+        if (!ringName.empty()) {
+            const size_t ringBytes = std::stoul(getEnv("SHM_RING_MB", "8")) << 20;
+            ring = std::make_unique<shm_ring::Producer>(ringName, ringBytes);
+            std::cout << "Shared-memory ring: " << ringName << " (" << (ringBytes >> 20) << " MB)\n";
+        }
+
+        scheduler = std::make_unique<BatchScheduler>(batchConfig, std::move(worker),
+            [this](std::vector<AsrResult> results) {
+                // Scheduler thread: hand the results to the io thread
+                boost::asio::post(server.get_io_service(), [this, results = std::move(results)]() {
+                    route_results(results);
+                });
+            });
     }
-    
+
     void run(uint16_t port) {
         server.listen(port);
         server.start_accept();
-        std::cout << "WebSocket server listening on port " << port << std::endl;
+        schedule_pings();
+        std::cout << "WebSocket server listening on port " << port
+                  << (secure ? " (TLS)" : "") << "\n"
+                  << "Link: latency " << link.latencyMs << "ms, jitter " << link.jitterMs
+                  << "ms, bandwidth " << (link.bandwidthKbps > 0 ? std::to_string(link.bandwidthKbps) + " kbps" : "unlimited")
+                  << ", disconnect p=" << link.disconnectProb << std::endl;
         server.run();
     }
 
 private:
+    enum class SessionKind { Raw, EngineIO, Asr };
+
+    struct Session {
+        uint64_t id = 0;
+        SessionKind kind = SessionKind::Raw;
+        std::string sid;
+        bool ttsJoined = false;
+        bool backpressure = false;      // Client was told to slow down
+        Clock::time_point lastPong = Clock::now();
+        // Frames arrive in the order they were sent: the link is busy until
+        // the last byte is out, no frame arrives before the one sent ahead
+        // of it, and one timer drains the outbox front to back
+        Clock::time_point linkFreeAt = Clock::now();
+        Clock::time_point lastArrival = Clock::now();
+        std::deque<std::pair<Clock::time_point, std::string>> outbox;
+        bool draining = false;
+    };
+
+    // ---- connection lifecycle -------------------------------------------
+
+    void handle_open(ConnectionHdl hdl) {
+        auto con = server.get_con_from_hdl(hdl);
+        const std::string resource = con->get_resource();
+        Session& session = sessions[hdl];
+        session.id = ++lastSessionId;
+        sessionIds[session.id] = hdl;
+
+        if (resource.rfind("/socket.io/", 0) == 0) {
+            session.kind = SessionKind::EngineIO;
+            session.sid = random_id(20);
+            std::cout << "Engine.IO client connected (" << session.sid << ")\n";
+
+            std::ostringstream open;
+            open << "0{\"sid\":\"" << session.sid << "\",\"upgrades\":[],"
+                 << "\"pingInterval\":" << pingIntervalMs << ","
+                 << "\"pingTimeout\":" << pingTimeoutMs << ","
+                 << "\"maxPayload\":1000000}";
+            deliver(hdl, open.str());
+        } else if (resource.rfind("/api/asr-batch-stream/ws/", 0) == 0) {
+            session.kind = SessionKind::Asr;
+            session.sid = resource.substr(std::string("/api/asr-batch-stream/ws/").size());
+            std::cout << "ASR client connected (" << session.sid << ")\n";
+        } else {
+            std::cout << "Client connected\n";
+        }
+
+        if (link.disconnectAfterMs > 0) {
+            after(std::chrono::milliseconds(link.disconnectAfterMs), [this, hdl]() {
+                drop(hdl, "scheduled disconnect");
+            });
+        }
+    }
+
     void handle_message(ConnectionHdl hdl, Message msg) {
-        if (msg->get_opcode() == websocketpp::frame::opcode::binary) {
-            auto now = std::chrono::system_clock::now();
-            auto time = std::chrono::system_clock::to_time_t(now);
-            std::tm tm;
-            localtime_r(&time, &tm);
-            
-            char filename[64];
-            std::strftime(filename, sizeof(filename), "output_test/rec_%Y%m%d_%H%M%S.wav", &tm);
-            
-            std::ofstream file(filename, std::ios::binary);
-            if (file) {
-                const auto& payload = msg->get_payload();
-                file.write(payload.data(), payload.size());
-                file.close();
-                std::cout << "Saved audio to: " << filename << " (" << payload.size() << " bytes)\n";
-            } else {
-                std::cerr << "Failed to save audio to: " << filename << std::endl;
+        auto it = sessions.find(hdl);
+        if (it == sessions.end()) return;
+        Session& session = it->second;
+
+        switch (session.kind) {
+            case SessionKind::EngineIO:
+                handle_engineio(hdl, session, msg->get_payload());
+                break;
+            case SessionKind::Asr:
+                handle_asr(hdl, session, msg->get_payload());
+                break;
+            case SessionKind::Raw:
+                if (msg->get_opcode() == websocketpp::frame::opcode::binary) {
+                    submit_audio(hdl, session, msg->get_payload(), -1);
+                }
+                break;
+        }
+    }
+
+    // ---- Engine.IO / Socket.IO ------------------------------------------
+
+    void handle_engineio(ConnectionHdl hdl, Session& session, const std::string& packet) {
+        if (packet.empty()) return;
+
+        switch (packet[0]) {
+            case '3': // pong
+                session.lastPong = Clock::now();
+                break;
+            case '2': // client-initiated ping (not used by v4 clients, answer anyway)
+                deliver(hdl, "3");
+                break;
+            case '4':
+                if (packet.rfind("40/tts", 0) == 0) {
+                    session.ttsJoined = true;
+                    const std::string nsSid = random_id(20);
+                    deliver(hdl, "40/tts,{\"sid\":\"" + nsSid + "\"}");
+                    emit(hdl, "connected", "{\"type\":\"connected\",\"message\":\"Socket.IO TTS connection established\","
+                                           "\"timestamp\":\"" + iso_now() + "\",\"socketId\":\"" + nsSid + "\"}");
+                    start_script(hdl);
+                } else if (packet.rfind("41/tts", 0) == 0) {
+                    session.ttsJoined = false;
+                }
+                break;
+            case '1': // close
+                server.close(hdl, websocketpp::close::status::normal, "client close");
+                break;
+        }
+    }
+
+    void emit(ConnectionHdl hdl, const std::string& event, const std::string& data) {
+        deliver(hdl, "42/tts,[\"" + event + "\"," + data + "]");
+    }
+
+    void broadcast(const std::string& event, const std::string& data) {
+        for (auto& [hdl, session] : sessions) {
+            if (session.kind == SessionKind::EngineIO && session.ttsJoined) {
+                emit(hdl, event, data);
+            }
+        }
+    }
+
+    // Periodic server pings; clients that miss the timeout are dropped
+    void schedule_pings() {
+        after(std::chrono::milliseconds(pingIntervalMs), [this]() {
+            const auto now = Clock::now();
+            std::vector<ConnectionHdl> stale;
+            for (auto& [hdl, session] : sessions) {
+                if (session.kind != SessionKind::EngineIO) continue;
+                if (now - session.lastPong > std::chrono::milliseconds(pingIntervalMs + pingTimeoutMs)) {
+                    stale.push_back(hdl);
+                } else {
+                    deliver(hdl, "2");
+                }
+            }
+            for (auto& hdl : stale) {
+                drop(hdl, "ping timeout");
+            }
+            schedule_pings();
+        });
+    }
+
+    // Sentence-by-sentence TTS as the production server does it
+    void emit_sentences(const std::string& text) {
+        std::vector<std::string> sentences;
+        std::string current;
+        for (char c : text) {
+            current += c;
+            if (c == '.' || c == '!' || c == '?') {
+                sentences.push_back(current);
+                current.clear();
+            }
+        }
+        if (current.find_first_not_of(' ') != std::string::npos) sentences.push_back(current);
+
+        const size_t total = sentences.size();
+        for (size_t i = 0; i < total; ++i) {
+            const std::string sentence = json::escape(sentences[i]);
+            const std::string& wav = fixture_for(sentences[i]);
+            const std::string audio = websocketpp::base64_encode(
+                reinterpret_cast<const unsigned char*>(wav.data()), wav.size());
+            const std::string index = std::to_string(i + 1);
+            const std::string count = std::to_string(total);
+
+            // Each sentence becomes available after its synthesis time
+            after(std::chrono::milliseconds(link.synthMs * static_cast<int>(i + 1)),
+                  [this, sentence, audio, index, count]() {
+                broadcast("sentence_start", "{\"type\":\"sentence_start\",\"sentenceIndex\":" + index +
+                                            ",\"totalSentences\":" + count + ",\"sentence\":\"" + sentence +
+                                            "\",\"sessionId\":null}");
+                broadcast("sentence_audio", "{\"type\":\"sentence_audio\",\"sentenceIndex\":" + index +
+                                            ",\"totalSentences\":" + count + ",\"audioData\":\"" + audio +
+                                            "\",\"sentence\":\"" + sentence + "\",\"sessionId\":null}");
+            });
+        }
+    }
+
+    // STUB_SCRIPT: "<delay_ms> <event> <json>" per line, replayed to every
+    // client that joins /tts. Lines starting with # are ignored.
+    void load_script(const std::string& path) {
+        if (path.empty()) return;
+        std::ifstream file(path);
+        if (!file) {
+            std::cerr << "Failed to open script: " << path << std::endl;
+            return;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream ls(line);
+            ScriptStep step;
+            ls >> step.delayMs >> step.event;
+            std::getline(ls >> std::ws, step.data);
+            if (!step.event.empty()) script.push_back(step);
+        }
+        std::cout << "Loaded " << script.size() << " scripted events from " << path << "\n";
+    }
+
+    void start_script(ConnectionHdl hdl) {
+        int at = 0;
+        for (const ScriptStep& step : script) {
+            at += step.delayMs;
+            after(std::chrono::milliseconds(at), [this, hdl, step]() {
+                if (sessions.count(hdl)) emit(hdl, step.event, step.data);
+            });
+        }
+    }
+
+    // ---- ASR stream ------------------------------------------------------
+
+    void handle_asr(ConnectionHdl hdl, Session& session, const std::string& payload) {
+        const std::string type = json::getString(payload, "type");
+        if (type == "config") {
+            const int channels = static_cast<int>(json::getNumber(payload, "channels", 1));
+            deliver(hdl, "{\"type\":\"config_ack\",\"channels\":" + std::to_string(channels) + "}");
+        } else if (type == "audio") {
+            std::string data;
+            if (!json::getString(payload, "data", data)) return;
+            const int channel = static_cast<int>(json::getNumber(payload, "channel", -1));
+            if (json::getNumber(payload, "gap_samples", 0) > 0) Metrics::instance().add("asr.capture_gaps");
+            submit_audio(hdl, session, websocketpp::base64_decode(data), channel);
+        } else if (type == "silence") {
+            // A chunk the client's voice gate kept home; not a capture gap
+            Metrics::instance().add("asr.silent_chunks");
+        } else if (type == "clock_ping") {
+            // t1/t2: receipt and reply on this host's clock; the link model
+            // then delays the pong like any other downlink message
+            const double t1 = epoch_ms();
+            char times[96];
+            std::snprintf(times, sizeof(times), "\"t0\":%.3f,\"t1\":%.3f,\"t2\":%.3f",
+                          json::getNumber(payload, "t0", 0), t1, epoch_ms());
+            deliver(hdl, "{\"type\":\"clock_pong\",\"id\":" +
+                         std::to_string(static_cast<uint64_t>(json::getNumber(payload, "id", 0))) + "," + times + "}");
+        }
+    }
+
+    void submit_audio(ConnectionHdl hdl, Session& session, std::string audio, int channel) {
+        // Without a consumer on the ring, fall back to the batch path rather
+        // than fill it up and drop everything
+        if (ring && ring->consumerAttached()) {
+            publish_pcm(hdl, session, audio, channel);
+            return;
+        }
+
+        AsrRequest req;
+        req.id = ++lastRequestId;
+        req.session = session.id;
+        req.channel = channel;
+        req.audio = std::move(audio);
+        if (!scheduler->submit(std::move(req)) && session.kind == SessionKind::Asr) {
+            deliver(hdl, "{\"type\":\"asr_busy\",\"id\":" + std::to_string(lastRequestId) + "}");
+        }
+    }
+
+    void publish_pcm(ConnectionHdl hdl, Session& session, const std::string& audio, int channel) {
+        shm_ring::RecordInfo info;
+        info.session = session.id;
+        info.channel = static_cast<int16_t>(channel);
+
+        const char* pcm = audio.data();
+        size_t bytes = audio.size();
+        WavView wav;
+        if (wav.parse(audio.data(), audio.size())) {
+            pcm = wav.pcmData();
+            bytes = wav.pcmBytes();
+            info.sampleRate = wav.format().sampleRate;
+            info.channels = wav.format().channels;
+        } else {
+            info.sampleRate = rawFormat.sampleRate;
+            info.channels = rawFormat.channels;
+        }
+
+        Metrics& m = Metrics::instance();
+        const auto status = ring->publish(info, pcm, bytes);
+        const double fill = ring->fill();
+        m.set("shm.fill", fill);
+        if (status == shm_ring::Producer::Status::Ok) {
+            m.add("shm.records");
+            m.add("shm.bytes", static_cast<double>(bytes));
+        } else {
+            m.add("shm.dropped");
+        }
+
+        // Tell ASR clients to back off above 75% (or on a drop) and to
+        // resume below 50%
+        if (session.kind != SessionKind::Asr) return;
+        const bool congested = status != shm_ring::Producer::Status::Ok || fill > 0.75;
+        if (congested != session.backpressure && (congested || fill < 0.5)) {
+            session.backpressure = congested;
+            deliver(hdl, std::string("{\"type\":\"backpressure\",\"active\":") +
+                             (congested ? "true" : "false") + ",\"fill\":" + std::to_string(fill) + "}");
+        }
+    }
+
+    // io thread: send each result to the connection its chunk came from.
+    // Raw recorder clients do not expect replies.
+    void route_results(const std::vector<AsrResult>& results) {
+        for (const AsrResult& result : results) {
+            if (!result.ok) {
+                std::cerr << "ASR request " << result.id << " failed: " << result.json << std::endl;
+            }
+            auto id = sessionIds.find(result.session);
+            if (id == sessionIds.end()) {
+                Metrics::instance().add("asr.orphaned");
+                continue;
+            }
+            auto it = sessions.find(id->second);
+            if (it != sessions.end() && it->second.kind == SessionKind::Asr) {
+                deliver(id->second, result.json);
+            }
+        }
+    }
+
+    // ---- HTTP ------------------------------------------------------------
+
+    void handle_http(ConnectionHdl hdl) {
+        auto con = server.get_con_from_hdl(hdl);
+        const std::string resource = con->get_resource();
+        const std::string body = con->get_request_body();
+
+        if (resource == "/api/tts/stream") {
+            const std::string text = json::getString(body, "text");
+            const std::string& wav = fixture_for(text);
+            std::cout << "TTS request: \"" << text << "\" -> " << wav.size() << " bytes\n";
+            respond_later(con, websocketpp::http::status_code::ok, "audio/wav", wav);
+        } else if (resource.rfind("/api/emit/", 0) == 0) {
+            const std::string event = resource.substr(std::string("/api/emit/").size());
+            broadcast(event, body.empty() ? "{}" : body);
+            respond_later(con, websocketpp::http::status_code::ok, "application/json", "{\"ok\":true}");
+        } else if (resource == "/api/sentences") {
+            emit_sentences(json::getString(body, "text"));
+            respond_later(con, websocketpp::http::status_code::ok, "application/json", "{\"ok\":true}");
+        } else {
+            con->set_status(websocketpp::http::status_code::not_found);
+            con->set_body("not found");
+        }
+    }
+
+    template <typename ConPtr>
+    void respond_later(ConPtr con, websocketpp::http::status_code::value status,
+                       const std::string& contentType, const std::string& body) {
+        con->set_status(status);
+        con->append_header("Content-Type", contentType);
+        con->set_body(body);
+
+        const auto delay = link_delay(body.size());
+        if (delay <= Clock::duration::zero()) return;
+
+        websocketpp::lib::error_code ec;
+        ec = con->defer_http_response();
+        if (ec) return;
+        after(delay, [con]() {
+            con->send_http_response();
+        });
+    }
+
+    // ---- link model ------------------------------------------------------
+
+    // Latency plus jitter for one payload
+    Clock::duration link_latency() {
+        auto delay = std::chrono::milliseconds(link.latencyMs);
+        if (link.jitterMs > 0) {
+            delay += std::chrono::milliseconds(std::uniform_int_distribution<int>(0, link.jitterMs)(rng));
+        }
+        return delay;
+    }
+
+    // Time `bytes` occupy the link at the configured bandwidth
+    Clock::duration link_transfer(size_t bytes) const {
+        if (link.bandwidthKbps <= 0) return Clock::duration::zero();
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(bytes * 8.0 / (link.bandwidthKbps * 1000.0)));
+    }
+
+    // Delay before a payload of `bytes` is fully delivered (HTTP responses,
+    // which have no session link)
+    Clock::duration link_delay(size_t bytes) {
+        return link_latency() + link_transfer(bytes);
+    }
+
+    // When a payload of `bytes` sent now on the session's link arrives: after
+    // whatever is still on the wire, and never before the previous frame
+    Clock::time_point link_arrival(size_t bytes, Session& session) {
+        const auto now = Clock::now();
+        session.linkFreeAt = std::max(now, session.linkFreeAt) + link_transfer(bytes);
+        session.lastArrival = std::max(session.linkFreeAt + link_latency(), session.lastArrival);
+        return session.lastArrival;
+    }
+
+    void deliver(ConnectionHdl hdl, const std::string& payload) {
+        auto it = sessions.find(hdl);
+        if (it == sessions.end()) return;
+
+        if (link.disconnectProb > 0 &&
+            std::uniform_real_distribution<double>(0.0, 1.0)(rng) < link.disconnectProb) {
+            drop(hdl, "injected disconnect");
+            return;
+        }
+
+        Session& session = it->second;
+        const auto arrival = link_arrival(payload.size(), session);
+        if (session.outbox.empty() && arrival <= Clock::now()) {
+            send_now(hdl, payload);
+            return;
+        }
+        session.outbox.emplace_back(arrival, payload);
+        if (!session.draining) {
+            session.draining = true;
+            after(arrival - Clock::now(), [this, hdl]() { drain(hdl); });
+        }
+    }
+
+    // Sends every outbox frame that has arrived, then waits for the next one
+    void drain(ConnectionHdl hdl) {
+        auto it = sessions.find(hdl);
+        if (it == sessions.end()) return;
+        Session& session = it->second;
+        while (!session.outbox.empty() && session.outbox.front().first <= Clock::now()) {
+            const std::string payload = std::move(session.outbox.front().second);
+            session.outbox.pop_front();
+            send_now(hdl, payload);
+        }
+        if (session.outbox.empty()) {
+            session.draining = false;
+            return;
+        }
+        after(session.outbox.front().first - Clock::now(), [this, hdl]() { drain(hdl); });
+    }
+
+    void send_now(ConnectionHdl hdl, const std::string& payload) {
+        if (!sessions.count(hdl)) return;
+        websocketpp::lib::error_code ec;
+        server.send(hdl, payload, websocketpp::frame::opcode::text, ec);
+        if (ec) {
+            std::cerr << "Send failed: " << ec.message() << std::endl;
+        }
+    }
+
+    void drop(ConnectionHdl hdl, const std::string& reason) {
+        if (!sessions.count(hdl)) return;
+        std::cout << "Dropping client: " << reason << "\n";
+        websocketpp::lib::error_code ec;
+        server.close(hdl, websocketpp::close::status::going_away, reason, ec);
+    }
+
+    template <typename Duration, typename Fn>
+    void after(Duration delay, Fn fn) {
+        auto timer = std::make_shared<boost::asio::steady_timer>(server.get_io_service(), delay);
+        timer->async_wait([timer, fn](const boost::system::error_code& ec) {
+            if (!ec) fn();
+        });
+    }
+
+    // ---- fixtures --------------------------------------------------------
+
+    // TTS_FIXTURES is a WAV file or a directory of them; texts map onto the
+    // fixtures by hash so the same text always yields the same audio
+    void load_fixtures(const std::string& path) {
+        std::vector<std::string> files;
+        std::error_code ec;
+        if (std::filesystem::is_directory(path, ec)) {
+            for (const auto& entry : std::filesystem::directory_iterator(path, ec)) {
+                if (entry.path().extension() == ".wav") files.push_back(entry.path().string());
+            }
+            std::sort(files.begin(), files.end());
+        } else {
+            files.push_back(path);
+        }
+
+        for (const std::string& file : files) {
+            try {
+                WavReader wav(file);
+                fixtures.emplace_back(wav.bytes(), wav.size());
+            } catch (const std::exception& e) {
+                std::cerr << "Skipping fixture: " << e.what() << std::endl;
             }
         }
+        std::cout << "Loaded " << fixtures.size() << " TTS fixture(s)\n";
+    }
+
+    const std::string& fixture_for(const std::string& text) {
+        static const std::string empty;
+        if (fixtures.empty()) return empty;
+        return fixtures[std::hash<std::string>{}(text) % fixtures.size()];
+    }
+
+    std::string random_id(size_t length) {
+        static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        std::uniform_int_distribution<size_t> dis(0, sizeof(chars) - 2);
+        std::string id;
+        for (size_t i = 0; i < length; ++i) id += chars[dis(rng)];
+        return id;
+    }
+
+    static double epoch_ms() {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static std::string iso_now() {
+        auto now = std::chrono::system_clock::now();
+        auto time = std::chrono::system_clock::to_time_t(now);
+        std::tm tm;
+        gmtime_r(&time, &tm);
+        char buf[32];
+        std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        return buf;
     }
 
+    struct ScriptStep {
+        int delayMs = 0;
+        std::string event;
+        std::string data;
+    };
+
     Server server;
-    std::set<ConnectionHdl, std::owner_less<ConnectionHdl>> connections;
+    WavFormat rawFormat;  // Assumed format of headerless uploads (16 kHz mono PCM16)
+    LinkConditions link;
+    std::mt19937 rng;
+    int pingIntervalMs = 25000;
+    int pingTimeoutMs = 20000;
+    std::vector<std::string> fixtures;
+    std::vector<ScriptStep> script;
+    std::map<ConnectionHdl, Session, std::owner_less<ConnectionHdl>> sessions;
+    std::map<uint64_t, ConnectionHdl> sessionIds;
+    uint64_t lastSessionId = 0;
+    uint64_t lastRequestId = 0;
+    std::unique_ptr<shm_ring::Producer> ring;
+    // Last member: its thread stops before anything it posts to goes away
+    std::unique_ptr<BatchScheduler> scheduler;
 };
 
+// `audio_server --asr-worker`: a stand-in ASR process for ASR_WORKER. Speaks
+// the PipeWorker protocol on stdin/stdout and answers each chunk with its
+// duration and level after sleeping ASR_STUB_BATCH_MS + n * ASR_STUB_ITEM_MS,
+// the cost shape of a batched model.
+static int run_asr_worker_stub() {
+    const int batchMs = std::stoi(getEnv("ASR_STUB_BATCH_MS", "40"));
+    const int itemMs = std::stoi(getEnv("ASR_STUB_ITEM_MS", "5"));
+    const WavFormat rawFormat;
+
+    char line[128];
+    std::string audio;
+    while (std::fgets(line, sizeof(line), stdin)) {
+        unsigned long count = 0;
+        if (std::sscanf(line, "batch %lu", &count) != 1) return 1;
+
+        std::ostringstream out;
+        for (unsigned long i = 0; i < count; ++i) {
+            unsigned long long id = 0, session = 0;
+            int channel = -1;
+            size_t bytes = 0;
+            if (!std::fgets(line, sizeof(line), stdin) ||
+                std::sscanf(line, "%llu %llu %d %zu", &id, &session, &channel, &bytes) != 4) {
+                return 1;
+            }
+            audio.resize(bytes);
+            if (bytes && std::fread(&audio[0], 1, bytes, stdin) != bytes) return 1;
+
+            // PCM16 samples, from the WAV image if it is one
+            const int16_t* samples = reinterpret_cast<const int16_t*>(audio.data());
+            size_t sampleCount = bytes / sizeof(int16_t);
+            double seconds = static_cast<double>(sampleCount) / rawFormat.sampleRate;
+            WavView wav;
+            if (wav.parse(audio.data(), audio.size())) {
+                samples = wav.samples();
+                sampleCount = wav.sampleCount();
+                seconds = wav.durationSeconds();
+            }
+            double energy = 0.0;
+            for (size_t k = 0; samples && k < sampleCount; ++k) energy += double(samples[k]) * samples[k];
+            const double rms = sampleCount ? std::sqrt(energy / sampleCount) / 32768.0 : 0.0;
+
+            out << "{\"type\":\"asr_result\",\"id\":" << id << ",\"channel\":" << channel
+                << ",\"batch_size\":" << count << ",\"duration_ms\":" << static_cast<int>(seconds * 1000)
+                << ",\"rms\":" << rms << "}\n";
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(batchMs + itemMs * static_cast<int>(count)));
+        const std::string reply = out.str();
+        std::fwrite(reply.data(), 1, reply.size(), stdout);
+        std::fflush(stdout);
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--asr-worker") {
+        return run_asr_worker_stub();
+    }
+
     try {
         uint16_t port = 9002; // Default port
         if (argc > 1) {
             port = static_cast<uint16_t>(std::stoi(argv[1]));
         }
-        
-        AudioServer server;
-        server.run(port);
+
+        // The clients only speak wss://, so serve TLS when a certificate is given
+        if (!getEnv("TLS_CERT").empty() && !getEnv("TLS_KEY").empty()) {
+            AudioServer<websocketpp::config::asio_tls> server;
+            server.run(port);
+        } else {
+            AudioServer<websocketpp::config::asio> server;
+            server.run(port);
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
@@ -92,6 +796,6 @@ int main(int argc, char* argv[]) {
         std::cerr << "Unknown error" << std::endl;
         return 1;
     }
-    
+
     return 0;
-} 
\ No newline at end of file
+}
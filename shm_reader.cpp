@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "shm_ring.hpp"
+
+// Example consumer for audio_server's shared-memory ring (SHM_RING). Reads
+// PCM records in place, keeps per-session totals and prints them once a
+// second. SHM_READER_DELAY_MS slows it down to exercise backpressure.
+//
+//   shm_reader /audio_ring
+
+using namespace std::chrono_literals;
+
+static volatile std::sig_atomic_t running = 1;
+
+static std::string getEnv(const char* key, const std::string& def = "") {
+    const char* v = std::getenv(key);
+    return v ? std::string(v) : def;
+}
+
+struct SessionStats {
+    uint64_t records = 0;
+    double seconds = 0.0;
+    double energy = 0.0;
+    uint64_t samples = 0;
+    double maxLatencyMs = 0.0;
+};
+
+int main(int argc, char** argv) {
+    const std::string name = argc > 1 ? argv[1] : getEnv("SHM_RING", "/audio_ring");
+    const auto delay = std::chrono::milliseconds(std::stoi(getEnv("SHM_READER_DELAY_MS", "0")));
+
+    std::signal(SIGINT, [](int) { running = 0; });
+    std::signal(SIGTERM, [](int) { running = 0; });
+
+    std::unique_ptr<shm_ring::Consumer> ring;
+    auto attach = [&]() {
+        ring.reset();
+        while (running && !ring) {
+            try {
+                ring = std::make_unique<shm_ring::Consumer>(name);
+            } catch (const std::exception& e) {
+                std::cerr << "Waiting for ring: " << e.what() << std::endl;
+                std::this_thread::sleep_for(1s);
+            }
+        }
+        if (ring) std::cout << "Attached to " << name << std::endl;
+    };
+    attach();
+    if (!ring) return 0;
+
+    std::map<uint64_t, SessionStats> sessions;
+    auto lastReport = std::chrono::steady_clock::now();
+    while (running) {
+        shm_ring::Record rec;
+        if (ring->retired()) {
+            // The server restarted (or exited): follow it to the new segment
+            std::cout << "Ring retired by the producer, reattaching" << std::endl;
+            sessions.clear();
+            attach();
+            if (!ring) break;
+        } else if (!ring->peek(rec)) {
+            ring->wait(100ms);
+        } else {
+            const shm_ring::RecordHeader& h = *rec.header;
+            if (h.kind == shm_ring::SessionEnd) {
+                auto it = sessions.find(h.session);
+                if (it != sessions.end()) {
+                    std::cout << "Session " << h.session << " ended: " << it->second.records << " records, "
+                              << it->second.seconds << " s" << std::endl;
+                    sessions.erase(it);
+                }
+            } else if (h.kind == shm_ring::Pcm) {
+                SessionStats& s = sessions[h.session];
+                const int16_t* samples = rec.samples();
+                const size_t n = rec.sampleCount();
+                for (size_t i = 0; i < n; ++i) s.energy += double(samples[i]) * samples[i];
+                s.samples += n;
+                s.records++;
+                if (h.sampleRate && h.channels) s.seconds += double(n) / h.channels / h.sampleRate;
+                s.maxLatencyMs = std::max(s.maxLatencyMs, (shm_ring::monotonicNs() - h.timestampNs) / 1e6);
+            }
+            ring->release();
+            if (delay.count() > 0) std::this_thread::sleep_for(delay);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastReport >= 1s) {
+            lastReport = now;
+            for (const auto& [id, s] : sessions) {
+                const double rms = s.samples ? std::sqrt(s.energy / s.samples) / 32768.0 : 0.0;
+                std::cout << "session " << id << ": " << s.records << " records, " << s.seconds
+                          << " s, rms " << rms << ", max latency " << s.maxLatencyMs << " ms\n";
+            }
+            std::cout << "dropped by producer: " << ring->dropped() << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+// Single-producer / single-consumer ring of PCM records in POSIX shared
+// memory, for handing audio from audio_server to an ASR process on the same
+// host without touching disk.
+//
+// The segment is a Header followed by `capacity` bytes of records. Read and
+// write positions are monotonically increasing byte counts; each side only
+// stores its own position, with release/acquire ordering on the payload.
+// Records are 8-byte aligned and never wrap: when one does not fit before the
+// end of the buffer the producer writes a Pad record (or, if even that does
+// not fit, leaves a gap the consumer skips) and starts again at offset 0.
+// Consumers read samples in place and release them when done.
+//
+// Backpressure: a full ring refuses records (publish() returns Full and the
+// dropped counter in the header grows) rather than blocking the server, and
+// fill() lets the producer tell clients to slow down before that happens.
+//
+// Lifetime: a producer never reuses a segment in place. It marks any
+// previous segment of the same name retired, unlinks it and creates a new
+// one, so a consumer still mapping the old one sees the flag and reattaches
+// instead of reading memory that was zeroed under it. The consumer's pid is
+// checked for liveness, so a consumer that died without detaching does not
+// keep the producer publishing into a ring nobody drains.
+namespace shm_ring {
+
+constexpr uint32_t kMagic = 0x474e4952;   // "RING"
+constexpr uint32_t kVersion = 2;
+
+enum RecordKind : uint32_t {
+    Pcm = 1,            // PCM16 interleaved samples
+    Pad = 2,            // Filler up to the end of the buffer
+    SessionEnd = 3,     // Connection closed; no payload
+};
+
+struct RecordHeader {
+    uint32_t size;          // Payload bytes, excluding this header
+    uint32_t kind;
+    uint64_t session;
+    uint64_t seq;           // Per-ring record number
+    int64_t timestampNs;    // steady_clock (CLOCK_MONOTONIC) at publish
+    uint32_t sampleRate;
+    uint16_t channels;
+    int16_t channel;        // Capture channel, -1 for mixed/mono
+};
+static_assert(sizeof(RecordHeader) == 40, "record layout is shared between processes");
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;                          // Power of two
+
+    alignas(64) std::atomic<uint64_t> writePos; // Producer-owned
+    std::atomic<uint32_t> writeSeq;             // Futex word, bumped per publish
+    std::atomic<uint64_t> dropped;              // Records refused for lack of space
+    std::atomic<uint32_t> retired;              // Set when the producer has left this segment
+
+    alignas(64) std::atomic<uint64_t> readPos;  // Consumer-owned
+    std::atomic<uint32_t> consumerWaiting;
+    std::atomic<int32_t> consumerPid;           // 0 when nobody is attached
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory atomics must be lock-free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared-memory atomics must be lock-free");
+
+inline constexpr size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+inline int64_t monotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// What a record describes; the producer fills in seq and timestampNs
+struct RecordInfo {
+    uint32_t kind = Pcm;
+    uint64_t session = 0;
+    uint32_t sampleRate = 16000;
+    uint16_t channels = 1;
+    int16_t channel = -1;
+};
+
+class Producer {
+public:
+    enum class Status { Ok, Full, TooLarge };
+
+    // Creates the segment /name with `capacity` data bytes, rounded up to a
+    // power of two, retiring whatever segment had the name before
+    Producer(const std::string& name, size_t capacity) : name(name) {
+        size_t cap = 4096;
+        while (cap < capacity) cap <<= 1;
+
+        retirePrevious();
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) throw std::runtime_error("shm_open failed: " + name);
+        mappedSize = sizeof(Header) + cap;
+        if (ftruncate(fd, static_cast<off_t>(mappedSize)) != 0) {
+            close(fd);
+            throw std::runtime_error("ftruncate failed: " + name);
+        }
+        void* p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap failed: " + name);
+        }
+        // Pages are touched now rather than on the first publish
+        std::memset(p, 0, mappedSize);
+
+        header = new (p) Header();
+        header->capacity = cap;
+        header->version = kVersion;
+        data = static_cast<char*>(p) + sizeof(Header);
+        // Consumers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = kMagic;
+    }
+
+    ~Producer() {
+        if (header) {
+            retire(header);
+            munmap(header, mappedSize);
+        }
+        if (fd >= 0) close(fd);
+        shm_unlink(name.c_str());
+    }
+
+    Producer(const Producer&) = delete;
+    Producer& operator=(const Producer&) = delete;
+
+    Status publish(const RecordInfo& info, const void* payload, size_t size) {
+        const uint64_t cap = header->capacity;
+        const size_t total = align8(sizeof(RecordHeader) + size);
+        if (total > cap / 2) return Status::TooLarge;
+
+        uint64_t pos = header->writePos.load(std::memory_order_relaxed);
+        const uint64_t readPos = header->readPos.load(std::memory_order_acquire);
+        const uint64_t offset = pos & (cap - 1);
+        const uint64_t tail = cap - offset;
+        const uint64_t needed = tail < total ? tail + total : total;
+
+        if (needed > cap - (pos - readPos)) {
+            header->dropped.fetch_add(1, std::memory_order_relaxed);
+            return Status::Full;
+        }
+
+        if (tail < total) {
+            // Skip to the start; a Pad record tells the consumer why
+            if (tail >= sizeof(RecordHeader)) {
+                RecordHeader pad{};
+                pad.kind = Pad;
+                pad.size = static_cast<uint32_t>(tail - sizeof(RecordHeader));
+                std::memcpy(data + offset, &pad, sizeof(pad));
+            }
+            pos += tail;
+        }
+
+        RecordHeader rec{};
+        rec.size = static_cast<uint32_t>(size);
+        rec.kind = info.kind;
+        rec.session = info.session;
+        rec.seq = nextSeq++;
+        rec.timestampNs = monotonicNs();
+        rec.sampleRate = info.sampleRate;
+        rec.channels = info.channels;
+        rec.channel = info.channel;
+
+        char* dst = data + (pos & (cap - 1));
+        std::memcpy(dst, &rec, sizeof(rec));
+        if (size) std::memcpy(dst + sizeof(rec), payload, size);
+
+        header->writePos.store(pos + total, std::memory_order_release);
+        header->writeSeq.fetch_add(1, std::memory_order_seq_cst);
+        if (header->consumerWaiting.load(std::memory_order_seq_cst)) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->writeSeq), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+        }
+        return Status::Ok;
+    }
+
+    // Used fraction of the ring, 0..1
+    double fill() const {
+        const uint64_t used = header->writePos.load(std::memory_order_relaxed) -
+                              header->readPos.load(std::memory_order_acquire);
+        return static_cast<double>(used) / static_cast<double>(header->capacity);
+    }
+
+    // A consumer that was killed never clears its pid; it is cleared here
+    // once the process is gone
+    bool consumerAttached() const {
+        int32_t pid = header->consumerPid.load(std::memory_order_relaxed);
+        if (pid == 0) return false;
+        if (kill(pid, 0) == 0 || errno != ESRCH) return true;
+        header->consumerPid.compare_exchange_strong(pid, 0, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t dropped() const { return header->dropped.load(std::memory_order_relaxed); }
+    const std::string& getName() const { return name; }
+
+private:
+    // Wakes a waiting consumer so it notices
+    static void retire(Header* h) {
+        h->retired.store(1, std::memory_order_release);
+        h->writeSeq.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&h->writeSeq), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    }
+
+    // Left behind by a producer that crashed, or still mapped by a consumer
+    void retirePrevious() {
+        const int old = shm_open(name.c_str(), O_RDWR, 0);
+        if (old < 0) return;
+        struct stat st;
+        if (fstat(old, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+            void* p = mmap(nullptr, sizeof(Header), PROT_READ | PROT_WRITE, MAP_SHARED, old, 0);
+            if (p != MAP_FAILED) {
+                auto* h = static_cast<Header*>(p);
+                if (h->magic == kMagic && h->version == kVersion) retire(h);
+                munmap(p, sizeof(Header));
+            }
+        }
+        close(old);
+    }
+
+    std::string name;
+    int fd = -1;
+    size_t mappedSize = 0;
+    Header* header = nullptr;
+    char* data = nullptr;
+    uint64_t nextSeq = 0;
+};
+
+// A record as seen by the consumer; pointers stay valid until release()
+struct Record {
+    const RecordHeader* header = nullptr;
+    const char* payload = nullptr;
+
+    const int16_t* samples() const { return reinterpret_cast<const int16_t*>(payload); }
+    size_t sampleCount() const { return header->size / sizeof(int16_t); }
+};
+
+class Consumer {
+public:
+    explicit Consumer(const std::string& name) {
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) throw std::runtime_error("shm_open failed: " + name);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("Not a ring: " + name);
+        }
+        mappedSize = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap failed: " + name);
+        }
+        header = static_cast<Header*>(p);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->magic != kMagic || header->version != kVersion ||
+            sizeof(Header) + header->capacity != mappedSize) {
+            munmap(p, mappedSize);
+            close(fd);
+            throw std::runtime_error("Incompatible ring: " + name);
+        }
+        if (header->retired.load(std::memory_order_acquire)) {
+            munmap(p, mappedSize);
+            close(fd);
+            throw std::runtime_error("Ring retired: " + name);
+        }
+        data = static_cast<const char*>(p) + sizeof(Header);
+
+        // Start from the live edge; whatever was queued before we attached
+        // belongs to a previous consumer
+        readPos = header->writePos.load(std::memory_order_acquire);
+        header->readPos.store(readPos, std::memory_order_release);
+        header->consumerPid.store(static_cast<int32_t>(getpid()), std::memory_order_relaxed);
+    }
+
+    ~Consumer() {
+        if (header) {
+            header->consumerPid.store(0, std::memory_order_relaxed);
+            munmap(header, mappedSize);
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    Consumer(const Consumer&) = delete;
+    Consumer& operator=(const Consumer&) = delete;
+
+    // Next record without consuming it; false when the ring is empty.
+    // Pad records and gaps are skipped here.
+    bool peek(Record& rec) {
+        const uint64_t cap = header->capacity;
+        const uint64_t writePos = header->writePos.load(std::memory_order_acquire);
+        while (readPos != writePos) {
+            const uint64_t offset = readPos & (cap - 1);
+            const uint64_t tail = cap - offset;
+            if (tail < sizeof(RecordHeader)) {
+                readPos += tail;
+                continue;
+            }
+            const auto* h = reinterpret_cast<const RecordHeader*>(data + offset);
+            if (h->kind == Pad) {
+                readPos += tail;
+                continue;
+            }
+            rec.header = h;
+            rec.payload = data + offset + sizeof(RecordHeader);
+            pending = align8(sizeof(RecordHeader) + h->size);
+            return true;
+        }
+        // Hand skipped padding back to the producer
+        header->readPos.store(readPos, std::memory_order_release);
+        return false;
+    }
+
+    // Frees the record returned by the last peek()
+    void release() {
+        readPos += pending;
+        pending = 0;
+        header->readPos.store(readPos, std::memory_order_release);
+    }
+
+    // Blocks until something is published or the timeout passes
+    void wait(std::chrono::milliseconds timeout) {
+        const uint32_t seq = header->writeSeq.load(std::memory_order_seq_cst);
+        header->consumerWaiting.store(1, std::memory_order_seq_cst);
+        if (header->writePos.load(std::memory_order_seq_cst) == readPos) {
+            timespec ts;
+            ts.tv_sec = timeout.count() / 1000;
+            ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->writeSeq), FUTEX_WAIT, seq, &ts, nullptr, 0);
+        }
+        header->consumerWaiting.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const { return header->dropped.load(std::memory_order_relaxed); }
+
+    // The producer has moved to a new segment (or exited): reattach by name
+    bool retired() const { return header->retired.load(std::memory_order_acquire) != 0; }
+
+private:
+    int fd = -1;
+    size_t mappedSize = 0;
+    Header* header = nullptr;
+    const char* data = nullptr;
+    uint64_t readPos = 0;
+    uint64_t pending = 0;
+};
+
+} // namespace shm_ring
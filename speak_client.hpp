@@ -0,0 +1,846 @@
+#pragma once
+
+#include <websocketpp/client.hpp>
+#include <websocketpp/base64/base64.hpp>
+#include <boost/asio/ssl.hpp>
+#include <curl/curl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <regex>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "async_runtime.hpp"
+#include "buffer_pool.hpp"
+#include "echo_reference.hpp"
+#include "json_util.hpp"
+#include "metrics.hpp"
+#include "mixer.hpp"
+#include "realtime.hpp"
+#include "tts_postprocess.hpp"
+#include "utterance_scheduler.hpp"
+#include "wav_file.hpp"
+#include "ws_config.hpp"
+
+// TTS client and Socket.IO /tts client used by speak and replay
+
+using namespace std::chrono_literals;
+
+// Define WebSocket client types (TLS with permessage-deflate)
+using Client = websocketpp::client<TlsDeflateClientConfig>;
+using ConnectionHdl = websocketpp::connection_hdl;
+using ErrorCode = websocketpp::lib::error_code;
+
+// Helper function to get environment variables
+inline std::string getEnv(const char* key, const std::string& def = "") {
+    const char* v = std::getenv(key);
+    return v ? std::string(v) : def;
+}
+
+// Callback function to stream received data straight into the output file
+inline size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    auto* file = static_cast<std::FILE*>(userp);
+    return std::fwrite(contents, size, nmemb, file) * size;
+}
+
+class TTSClient {
+public:
+    TTSClient()
+        : player(getEnv("SPEAK_PLAYER", "paplay")),
+          rtSettings(rt::Settings::fromEnv()),
+          useMixer(getEnv("SPEAK_MIXER") == "1") {
+        // Initialize CURL
+        curl_global_init(CURL_GLOBAL_ALL);
+        curl = curl_easy_init();
+        if (!curl) {
+            throw std::runtime_error("Failed to initialize CURL");
+        }
+        
+        // Set common options
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        
+        // Set headers
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+    
+    ~TTSClient() {
+        if (headers) {
+            curl_slist_free_all(headers);
+        }
+        if (curl) {
+            curl_easy_cleanup(curl);
+        }
+        curl_global_cleanup();
+    }
+    
+    bool textToSpeech(const std::string& text, const std::string& outputFile) {
+        if (!curl) return false;
+        
+        try {
+            // Prepare JSON payload
+            std::string jsonPayload = "{\"text\": \"" + text + "\"}";
+            
+            // Set POST data
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonPayload.c_str());
+            
+            // Set URL
+            std::string url = getEnv("TTS_URL", "https://robot-asr.pvi.digital/api/tts/stream");
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            
+            // Stream the response body to the output file as it arrives
+            std::FILE* outFile = std::fopen(outputFile.c_str(), "wb");
+            if (!outFile) {
+                std::cerr << "❌ Failed to open output file: " << outputFile << std::endl;
+                return false;
+            }
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, outFile);
+            
+            // Perform request
+            std::cout << "🎤 Requesting TTS for text: " << text << std::endl;
+            CURLcode res = curl_easy_perform(curl);
+            std::fclose(outFile);
+            
+            if (res != CURLE_OK) {
+                std::cerr << "❌ Failed to perform request: " 
+                          << curl_easy_strerror(res) << std::endl;
+                std::filesystem::remove(outputFile);
+                return false;
+            }
+            
+            // Get HTTP response code
+            long httpCode = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+            
+            if (httpCode != 200) {
+                std::cerr << "❌ Server returned HTTP code " << httpCode << std::endl;
+                std::filesystem::remove(outputFile);
+                return false;
+            }
+            
+            // Reject error pages and empty bodies before they reach the player
+            try {
+                WavReader check(outputFile);
+            } catch (const std::exception& e) {
+                std::cerr << "❌ Invalid audio from TTS server: " << e.what() << std::endl;
+                std::filesystem::remove(outputFile);
+                return false;
+            }
+            
+            std::cout << "✅ Audio saved to: " << outputFile << std::endl;
+            return true;
+            
+        } catch (const std::exception& e) {
+            std::cerr << "❌ Error in textToSpeech: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
+    // Replay benchmarks run without a sound card
+    void setPlaybackEnabled(bool enabled) {
+        playbackEnabled = enabled;
+    }
+    
+    // Blocks until playback ends; false if it failed or was stopped.
+    // `interrupted` is asked once the player can be stopped, so a
+    // stopPlayback() that came too early is not lost.
+    bool playAudio(const std::string& audioFile, AudioMixer::Role role = AudioMixer::Role::Speech,
+                   const std::function<bool()>& interrupted = nullptr) {
+        if (!playbackEnabled) return true;
+        if (AudioMixer* m = output()) return playMixed(*m, audioFile, role, interrupted);
+        
+        try {
+            // Play audio using paplay (PulseAudio) unless SPEAK_PLAYER says otherwise
+            std::cout << "🎵 Playing audio: " << player << " '" << audioFile << "'" << std::endl;
+            
+            // Let audio_uploader use this playback as its echo reference
+            echo_ref::publishReference(getEnv("AEC_REF_DIR", "/tmp/aec_ref"), audioFile);
+            
+            // The player gets RT_PRIORITY/RT_CPUS; underruns it reports are
+            // counted in playback.xruns
+            rt::Process proc = rt::spawn({player, audioFile}, rtSettings);
+            const pid_t pid = proc.pid;
+            if (pid < 0) {
+                std::cerr << "❌ Failed to start " << player << std::endl;
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(playerMutex);
+                playerPid = pid;
+            }
+            if (interrupted && interrupted()) kill(pid, SIGTERM);
+            rt::drainStderr(proc, "playback.xruns");
+            
+            // Wait without reaping so stopPlayback() never signals a reused pid
+            siginfo_t info{};
+            while (waitid(P_PID, static_cast<id_t>(pid), &info, WEXITED | WNOWAIT) != 0 && errno == EINTR) {}
+            {
+                std::lock_guard<std::mutex> lock(playerMutex);
+                playerPid = -1;
+                waitpid(pid, nullptr, 0);
+            }
+            
+            if (info.si_code != CLD_EXITED) {
+                std::cout << "⏹️ Playback stopped" << std::endl;
+                return false;
+            }
+            if (info.si_status != 0) {
+                std::cerr << "❌ Failed to play audio, " << player << " returned: " 
+                          << info.si_status << std::endl;
+                return false;
+            }
+            
+            return true;
+        } catch (const std::exception& e) {
+            std::cerr << "❌ Error playing audio: " << e.what() << std::endl;
+            return false;
+        }
+    }
+    
+    // Interrupts playAudio() from another thread
+    void stopPlayback() {
+        std::lock_guard<std::mutex> lock(playerMutex);
+        if (playerPid > 0) kill(playerPid, SIGTERM);
+        if (mixer && mixerStream) mixer->stop(mixerStream);
+    }
+    
+    // Plays an earcon or background clip alongside speech without waiting
+    // for it. Needs the mixer; with a per-file player it is skipped.
+    void playEffect(const std::string& audioFile, bool background, float gainDb = 0.0f) {
+        if (!playbackEnabled) return;
+        AudioMixer* m = output();
+        if (!m) {
+            std::cerr << "⚠️ Skipping " << audioFile << ": overlapping sounds need SPEAK_MIXER=1" << std::endl;
+            return;
+        }
+        std::cout << "🔔 Playing effect: '" << audioFile << "'" << std::endl;
+        m->play(audioFile, background ? AudioMixer::Role::Background : AudioMixer::Role::Effect, gainDb);
+    }
+    
+    // Stops earcons and background clips (speech is stopped with stopPlayback)
+    void stopEffects() {
+        std::lock_guard<std::mutex> lock(playerMutex);
+        if (!mixer) return;
+        mixer->stopRole(AudioMixer::Role::Effect);
+        mixer->stopRole(AudioMixer::Role::Background);
+    }
+
+private:
+    CURL* curl = nullptr;
+    struct curl_slist* headers = nullptr;
+    bool playbackEnabled = true;
+    std::string player;
+    rt::Settings rtSettings;
+    std::mutex playerMutex;
+    pid_t playerPid = -1;
+    
+    // The mixer, started on first use so replay never opens the device;
+    // null when SPEAK_MIXER is off or aplay could not be started
+    AudioMixer* output() {
+        std::lock_guard<std::mutex> lock(playerMutex);
+        if (useMixer && !mixer) {
+            mixer = std::make_unique<AudioMixer>(AudioMixer::Config::fromEnv(), rtSettings);
+            if (!mixer->start()) {
+                std::cerr << "❌ Mixer unavailable, falling back to " << player << std::endl;
+                mixer.reset();
+                useMixer = false;
+            }
+        }
+        return mixer.get();
+    }
+    
+    bool playMixed(AudioMixer& m, const std::string& audioFile, AudioMixer::Role role,
+                   const std::function<bool()>& interrupted) {
+        std::cout << "🎵 Mixing audio: '" << audioFile << "'" << std::endl;
+        echo_ref::publishReference(getEnv("AEC_REF_DIR", "/tmp/aec_ref"), audioFile);
+        
+        std::promise<bool> done;
+        std::future<bool> result = done.get_future();
+        const AudioMixer::StreamId id = m.play(audioFile, role, 0.0f, [&done](bool completed) {
+            done.set_value(completed);
+        });
+        if (!id) return false;
+        {
+            std::lock_guard<std::mutex> lock(playerMutex);
+            mixerStream = id;
+        }
+        if (interrupted && interrupted()) m.stop(id);
+        const bool completed = result.get();
+        {
+            std::lock_guard<std::mutex> lock(playerMutex);
+            mixerStream = 0;
+        }
+        if (!completed) std::cout << "⏹️ Playback stopped" << std::endl;
+        return completed;
+    }
+    
+    bool useMixer = false;
+    std::unique_ptr<AudioMixer> mixer;
+    AudioMixer::StreamId mixerStream = 0;
+};
+
+class WebSocketClient {
+public:
+    // Stages a server message passes through, tagged with the message's
+    // sequence number: "received" and "decoded" on the thread handling the
+    // message, then for spoken messages "queued", "synthesized",
+    // "playback_start" and "playback_end" (or "dropped"/"preempted") on the
+    // utterance scheduler's thread.
+    using StageHandler = std::function<void(const char* stage, uint64_t seq)>;
+    using Priority = UtteranceScheduler::Priority;
+    
+    // The websocket runs on the caller's event loop, and its callbacks run
+    // on the runtime's strand together with the connection loop. Without a
+    // runtime the client can only be fed messages directly (replay).
+    explicit WebSocketClient(bool writeLog = true, AsyncRuntime* runtime = nullptr) : runtime(runtime) {
+        // Generate device ID
+        deviceId = "0612";
+        
+        // Open log file
+        if (writeLog) {
+            std::string timestamp = getCurrentTimestamp();
+            logFilePath = "websocket_log_" + timestamp + ".txt";
+            logFile.open(logFilePath, std::ios::app);
+            if (!logFile.is_open()) {
+                std::cerr << "Failed to open log file: " << logFilePath << std::endl;
+            }
+        }
+        
+        // Initialize TTS client
+        ttsClient = std::make_unique<TTSClient>();
+        
+        // Utterances are synthesized and played off the websocket thread
+        UtteranceScheduler::Config schedulerConfig;
+        schedulerConfig.budget[0] = std::chrono::milliseconds(std::stoi(getEnv("SPEAK_BUDGET_SAFETY_MS", "5000")));
+        schedulerConfig.budget[1] = std::chrono::milliseconds(std::stoi(getEnv("SPEAK_BUDGET_CONVERSATION_MS", "15000")));
+        schedulerConfig.budget[2] = std::chrono::milliseconds(std::stoi(getEnv("SPEAK_BUDGET_IDLE_MS", "30000")));
+        
+        UtteranceScheduler::Backend backend;
+        backend.synthesize = [this](const std::string& text, std::string& audioFile) {
+            audioFile = tempAudioFile();
+            if (!ttsClient->textToSpeech(text, audioFile)) return false;
+            // Padding trimmed and loudness matched before it is queued for playback
+            if (!synthPost.processFile(audioFile)) {
+                std::cerr << "❌ Failed to post-process " << audioFile << std::endl;
+            }
+            return true;
+        };
+        backend.play = [this](const std::string& audioFile, Priority priority,
+                              const UtteranceScheduler::InterruptCheck& interrupted) {
+            return ttsClient->playAudio(audioFile, priority == Priority::Safety ? AudioMixer::Role::Alert
+                                                                                : AudioMixer::Role::Speech,
+                                        interrupted);
+        };
+        backend.stop = [this]() { ttsClient->stopPlayback(); };
+        backend.discard = [](const std::string& audioFile) {
+            std::error_code ec;
+            std::filesystem::remove(audioFile, ec);
+        };
+        scheduler = std::make_unique<UtteranceScheduler>(schedulerConfig, std::move(backend),
+            [this](const char* name, uint64_t seq) { stage(name, seq); });
+        
+        // Set up WebSocket client
+        client.clear_access_channels(websocketpp::log::alevel::all);
+        client.set_access_channels(websocketpp::log::alevel::connect);
+        client.set_access_channels(websocketpp::log::alevel::disconnect);
+        client.set_access_channels(websocketpp::log::alevel::app);
+        
+        client.clear_error_channels(websocketpp::log::elevel::all);
+        client.set_error_channels(websocketpp::log::elevel::warn);
+        client.set_error_channels(websocketpp::log::elevel::rerror);
+        client.set_error_channels(websocketpp::log::elevel::fatal);
+        
+        boost::asio::any_io_executor executor;
+        if (runtime) {
+            client.init_asio(&runtime->context());
+            executor = runtime->strand();
+        } else {
+            client.init_asio();
+            executor = client.get_io_service().get_executor();
+        }
+        connectSlot = std::make_unique<CompletionSlot>(executor);
+        closeSlot = std::make_unique<CompletionSlot>(executor);
+        
+        // Configure TLS
+        client.set_tls_init_handler([](websocketpp::connection_hdl) {
+            auto ctx = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::sslv23);
+            ctx->set_options(boost::asio::ssl::context::default_workarounds |
+                           boost::asio::ssl::context::no_sslv2 |
+                           boost::asio::ssl::context::no_sslv3 |
+                           boost::asio::ssl::context::single_dh_use);
+            ctx->set_verify_mode(boost::asio::ssl::verify_none);
+            return ctx;
+        });
+        
+        // Register message handler
+        client.set_message_handler([this](ConnectionHdl hdl, Client::message_ptr msg) {
+            onStrand([this, msg]() {
+                Metrics::instance().add("ws.rx.messages");
+                Metrics::instance().add("ws.rx.bytes", static_cast<double>(msg->get_payload().size()));
+                handleServerMessage(msg->get_payload());
+            });
+        });
+        
+        // Register connection handlers
+        client.set_open_handler([this](ConnectionHdl hdl) {
+            onStrand([this]() {
+                std::cout << "✅ WebSocket connection established" << std::endl;
+                connected = true;
+                connectionFailed = false;
+                
+                // Send Socket.IO connection packet
+                sendConnectPacket();
+                connectSlot->complete();
+            });
+        });
+        
+        client.set_close_handler([this](ConnectionHdl hdl) {
+            onStrand([this]() {
+                std::cout << "🔌 WebSocket connection closed" << std::endl;
+                connected = false;
+                closeSlot->complete();
+            });
+        });
+        
+        client.set_fail_handler([this](ConnectionHdl hdl) {
+            const std::string reason = client.get_con_from_hdl(hdl)->get_ec().message();
+            onStrand([this, reason]() {
+                std::cout << "❌ WebSocket connection failed. Error: " << reason << std::endl;
+                connected = false;
+                connectionFailed = true;
+                connectSlot->complete(boost::asio::error::connection_refused);
+            });
+        });
+    }
+    
+    void handleServerMessage(const std::string& message) {
+        const uint64_t seq = ++messageSeq;
+        stage("received", seq);
+        try {
+            std::cout << "📥 Received: " << message << std::endl;
+            logMessage(message);
+            
+            // Handle Socket.IO packets
+            if (message.empty()) return;
+            
+            char type = message[0];
+            std::string payload = message.length() > 1 ? message.substr(1) : "";
+            
+            switch (type) {
+                case '0': // Socket.IO connect
+                    stage("decoded", seq);
+                    std::cout << "🔌 Socket.IO connected" << std::endl;
+                    logMessage("Socket.IO connected", "INFO");
+                    break;
+                    
+                case '2': // Socket.IO ping - respond with pong
+                    stage("decoded", seq);
+                    std::cout << "🏓 Ping received, sending pong" << std::endl;
+                    logMessage("Ping received, sending pong", "INFO");
+                    sendText("3");
+                    break;
+                    
+                case '4': // Socket.IO message/event
+                    logMessage("Processing Socket.IO message/event", "INFO");
+                    
+                    // Parse event message format: 42/tts,["event_name",{...}]
+                    size_t commaPos = payload.find(',');
+                    if (commaPos != std::string::npos) {
+                        std::string eventData = payload.substr(commaPos + 1);
+                        
+                        // Pre-synthesized sentences; checked first since the
+                        // payload is mostly base64
+                        if (eventData.rfind("[\"sentence_audio\"", 0) == 0) {
+                            handleSentenceAudio(eventData, seq);
+                            break;
+                        }
+                        
+                        // Check for navigation event with message
+                        if (eventData.find("\"navigation\"") != std::string::npos) {
+                            handleNavigationMessage(eventData, seq);
+                            break;
+                        }
+                        if (eventData.find("\"queue_assigned\"") != std::string::npos) {
+                            handleQueueAssigned(eventData, seq);
+                            break;
+                        }
+                        if (eventData.rfind("[\"tts_start\"", 0) == 0) {
+                            stage("decoded", seq);
+                            startReply(json::getString(eventData, "sessionId"));
+                            break;
+                        }
+                        if (eventData.rfind("[\"tts_end\"", 0) == 0 ||
+                            eventData.rfind("[\"sentence_error\"", 0) == 0) {
+                            handleReplyEnd(eventData, seq);
+                            break;
+                        }
+                        if (eventData.rfind("[\"earcon\"", 0) == 0) {
+                            handleEarcon(eventData, seq);
+                            break;
+                        }
+                        if (eventData.find("\"audio_stop\"") != std::string::npos) {
+                            stage("decoded", seq);
+                            std::cout << "⏹️ Stop requested by server" << std::endl;
+                            logMessage("Audio stop", "INFO");
+                            scheduler->stopAll();
+                            sentencePost.cancelAll();
+                            replies.clear();
+                            ttsClient->stopEffects();
+                            break;
+                        }
+                    }
+                    stage("decoded", seq);
+                    break;
+            }
+            
+        } catch (const std::exception& e) {
+            std::string error = "Error handling message: " + std::string(e.what());
+            std::cerr << error << std::endl;
+            logMessage(error, "ERROR");
+        }
+    }
+    
+    void handleNavigationMessage(const std::string& payload, uint64_t seq = 0) {
+        try {
+            // Extract message from navigation event
+            size_t messageStart = payload.find("\"message\":\"");
+            if (messageStart == std::string::npos) return;
+            
+            messageStart += 11; // Move past "message":"
+            size_t messageEnd = payload.find("\"", messageStart);
+            if (messageEnd == std::string::npos) return;
+            
+            std::string message = payload.substr(messageStart, messageEnd - messageStart);
+            if (message.empty()) return;
+            stage("decoded", seq);
+            
+            std::cout << "📢 Navigation message: " << message << std::endl;
+            logMessage("Navigation message: " + message, "INFO");
+            
+            // A newer direction replaces one that has not been spoken yet
+            scheduler->submit(priorityOf(payload, Priority::Safety), message, "navigation", seq);
+            
+        } catch (const std::exception& e) {
+            std::string error = "Error handling navigation message: " + std::string(e.what());
+            std::cerr << error << std::endl;
+            logMessage(error, "ERROR");
+        }
+    }
+    
+    void handleQueueAssigned(const std::string& payload, uint64_t seq = 0) {
+        std::string message;
+        const bool found = json::getString(payload, "message", message);
+        stage("decoded", seq);
+        if (!found || message.empty()) return;
+        
+        std::cout << "💬 Queue message: " << message << std::endl;
+        logMessage("Queue message: " + message, "INFO");
+        scheduler->submit(priorityOf(payload, Priority::Conversation), message, "", seq);
+    }
+    
+    // A reply of the server's, as this client tells them apart: sessionId is
+    // often null, so each reply gets a local key when it starts
+    struct Reply {
+        std::string key;
+        int lastIndex = 0;          // Highest sentenceIndex seen
+        int total = 0;              // totalSentences, once known
+    };
+    
+    // tts_start, or a sentence run restarting at 1 without one
+    Reply& startReply(const std::string& sessionId) {
+        Reply& reply = replies[sessionId];
+        reply = Reply();
+        reply.key = "r" + std::to_string(++replyCounter) + ":" + sessionId;
+        return reply;
+    }
+    
+    Reply& replyFor(const std::string& sessionId) {
+        auto it = replies.find(sessionId);
+        return it != replies.end() ? it->second : startReply(sessionId);
+    }
+    
+    // tts_end, or a sentence_error: a reply that will get no more sentences
+    // gives back the crossfade tail it is still holding
+    void handleReplyEnd(const std::string& payload, uint64_t seq) {
+        stage("decoded", seq);
+        const std::string sessionId = json::getString(payload, "sessionId");
+        auto it = replies.find(sessionId);
+        if (it == replies.end()) return;
+        const bool ended = payload.rfind("[\"tts_end\"", 0) == 0;
+        const int index = static_cast<int>(json::getNumber(payload, "sentenceIndex", 0));
+        if (!ended && (it->second.total == 0 || index < it->second.total)) return;
+        
+        std::vector<char> tail;
+        if (sentencePost.flush(it->second.key, tail)) {
+            queueAudio(tail, priorityOf(payload, Priority::Conversation), seq, it->second.key);
+        }
+        if (ended) replies.erase(it);
+    }
+    
+    // One sentence of a server-synthesized reply: trimmed, normalized and
+    // crossfaded into its neighbours, then queued behind earlier sentences
+    void handleSentenceAudio(const std::string& payload, uint64_t seq = 0) {
+        std::string audioData;
+        const bool found = json::getString(payload, "audioData", audioData);
+        stage("decoded", seq);
+        if (!found || audioData.empty()) return;
+        
+        const int index = static_cast<int>(json::getNumber(payload, "sentenceIndex", 1));
+        const int total = static_cast<int>(json::getNumber(payload, "totalSentences", index));
+        const std::string sessionId = json::getString(payload, "sessionId");
+        Reply& state = index <= 1 && replyFor(sessionId).lastIndex > 0 ? startReply(sessionId) : replyFor(sessionId);
+        state.lastIndex = std::max(state.lastIndex, index);
+        state.total = total;
+        const std::string reply = state.key;
+        const Priority priority = priorityOf(payload, Priority::Conversation);
+        
+        // Other replies that went quiet without a last sentence get their tails back
+        std::vector<char> tail;
+        while (sentencePost.flushStale(std::chrono::seconds(2), reply, tail)) {
+            queueAudio(tail, priority, seq);
+        }
+        
+        const std::string wav = websocketpp::base64_decode(audioData);
+        std::vector<char> processed;
+        if (!sentencePost.processSentence(reply, wav.data(), wav.size(), index <= 1, index >= total, processed)) {
+            std::cerr << "❌ sentence_audio " << index << " is not a WAV image" << std::endl;
+            return;
+        }
+        if (!queueAudio(processed, priority, seq, reply)) return;
+        
+        std::cout << "🗣️ Sentence " << index << "/" << total << " queued" << std::endl;
+        logMessage("Sentence audio " + std::to_string(index) + "/" + std::to_string(total), "INFO");
+    }
+    
+    // Writes a WAV image to a temporary file and hands it to the scheduler as
+    // a clip of `reply`
+    bool queueAudio(const std::vector<char>& image, Priority priority, uint64_t seq, const std::string& reply = "") {
+        const std::string file = tempAudioFile();
+        std::ofstream out(file, std::ios::binary);
+        out.write(image.data(), static_cast<std::streamsize>(image.size()));
+        out.close();
+        if (!out) {
+            std::cerr << "❌ Failed to write " << file << std::endl;
+            std::error_code ec;
+            std::filesystem::remove(file, ec);
+            return false;
+        }
+        scheduler->submitAudio(priority, file, "", seq, reply);
+        return true;
+    }
+    
+    // A short sound played over whatever is speaking, e.g.
+    // ["earcon",{"name":"chime","gain_db":-6}]; "background":true makes it
+    // duckable background audio. Names map to SPEAK_EARCON_DIR/<name>.wav.
+    void handleEarcon(const std::string& payload, uint64_t seq = 0) {
+        std::string name;
+        const bool found = json::getString(payload, "name", name);
+        stage("decoded", seq);
+        if (!found || name.empty() || name.find('/') != std::string::npos || name.find("..") != std::string::npos) {
+            std::cerr << "❌ Invalid earcon name: " << name << std::endl;
+            return;
+        }
+        
+        const std::string file = getEnv("SPEAK_EARCON_DIR", "/usr/share/sounds/speak") + "/" + name + ".wav";
+        const bool background = payload.find("\"background\":true") != std::string::npos;
+        logMessage("Earcon: " + name, "INFO");
+        ttsClient->playEffect(file, background, static_cast<float>(json::getNumber(payload, "gain_db", 0.0)));
+    }
+    
+    // Blocks until every queued utterance has been played or dropped
+    void waitIdle() {
+        scheduler->waitIdle();
+    }
+    
+    // Connects on the shared loop: `handler` runs there once the connection
+    // is open, or with an error if it failed or did not open within a second
+    void asyncConnect(const std::string& baseUrl, CompletionSlot::Handler handler) {
+        connectSlot->arm(std::move(handler), 1s);
+        try {
+            if (!startConnection(baseUrl)) connectSlot->complete(boost::asio::error::invalid_argument);
+        } catch (const std::exception& e) {
+            std::cerr << "Connection attempt failed: " << e.what() << std::endl;
+            connectSlot->complete(boost::asio::error::connection_refused);
+        }
+    }
+    
+    // `handler` runs on the loop when the open connection closes
+    void asyncWaitClosed(CompletionSlot::Handler handler) {
+        closeSlot->arm(std::move(handler));
+        if (!connected) closeSlot->complete();
+    }
+    
+    void sendConnectPacket() {
+        if (!connected) return;
+        
+        // Socket.IO connect packet to /tts namespace with auth data
+        std::stringstream ss;
+        ss << "40/tts,{\"auth\":{\"deviceId\":\"" << deviceId << "\"}}";
+        
+        websocketpp::lib::error_code ec = sendText(ss.str());
+        if (ec) {
+            std::cerr << "Failed to send connect packet: " << ec.message() << std::endl;
+        } else {
+            std::cout << "🔌 Socket.IO connect packet sent to /tts" << std::endl;
+        }
+    }
+    
+    void disconnect() {
+        if (connection && connected) {
+            try {
+                client.close(connection, websocketpp::close::status::normal, "");
+            } catch (...) {}
+        }
+        
+        connected = false;
+    }
+    
+    bool isConnected() const {
+        return connected;
+    }
+    
+    void setStageHandler(StageHandler handler) {
+        stageHandler = std::move(handler);
+    }
+    
+    TTSClient& tts() {
+        return *ttsClient;
+    }
+    
+    ~WebSocketClient() {
+        disconnect();
+        if (logFile.is_open()) {
+            logFile.close();
+        }
+    }
+
+private:
+    // Socket.IO handshake over a websocket transport; false if the
+    // connection could not be created
+    bool startConnection(const std::string& baseUrl) {
+        std::string handshakeUrl = baseUrl + "/socket.io/?EIO=4&transport=websocket";
+        std::cout << "🔄 Connecting to: " << handshakeUrl << std::endl;
+        
+        websocketpp::lib::error_code ec;
+        connection = client.get_connection(handshakeUrl, ec);
+        if (ec) {
+            std::cerr << "Failed to create connection: " << ec.message() << std::endl;
+            return false;
+        }
+        
+        // Set required headers for Socket.IO
+        connection->append_header("ngrok-skip-browser-warning", "true");
+        connection->append_header("User-Agent", "C++-SocketIO-Client");
+        
+        connectionFailed = false;
+        client.connect(connection);
+        return true;
+    }
+    
+    void stage(const char* name, uint64_t seq) {
+        if (stageHandler) stageHandler(name, seq);
+    }
+    
+    // The server may override the default class with "priority"
+    static Priority priorityOf(const std::string& payload, Priority def) {
+        const std::string name = json::getString(payload, "priority");
+        if (name == "safety") return Priority::Safety;
+        if (name == "conversation") return Priority::Conversation;
+        if (name == "idle") return Priority::Idle;
+        return def;
+    }
+    
+    // Sends a text frame through the message pool, compressing it only when
+    // the deflate policy says it is worth it
+    websocketpp::lib::error_code sendText(const std::string& text) {
+        auto msg = messagePool.acquire(websocketpp::frame::opcode::text, text.size());
+        msg->get_raw_payload() += text;
+        const bool compress = DeflateSettings::current().shouldCompress(false, text.size());
+        msg->set_compressed(compress);
+        
+        websocketpp::lib::error_code ec;
+        auto start = DeflateStats::Clock::now();
+        client.send(connection, msg, ec);
+        if (!ec) {
+            deflateStats.record(text, compress, DeflateStats::Clock::now() - start);
+        }
+        return ec;
+    }
+    
+    std::string tempAudioFile() {
+        return "/tmp/tts_" + getCurrentTimestamp() + "_" + std::to_string(++utteranceCounter) + ".wav";
+    }
+    
+    std::string getCurrentTimestamp() {
+        auto now = std::chrono::system_clock::now();
+        auto now_time_t = std::chrono::system_clock::to_time_t(now);
+        std::stringstream ss;
+        ss << std::put_time(std::localtime(&now_time_t), "%Y%m%d_%H%M%S");
+        return ss.str();
+    }
+
+    void logMessage(const std::string& message, const std::string& prefix = "SERVER") {
+        if (!logFile.is_open()) return;
+        
+        auto now = std::chrono::system_clock::now();
+        auto now_time_t = std::chrono::system_clock::to_time_t(now);
+        
+        logFile << "[" << std::put_time(std::localtime(&now_time_t), "%Y-%m-%d %H:%M:%S") 
+                << "] " << prefix << ": " << message << std::endl;
+        logFile.flush();
+    }
+
+    // websocketpp calls back from its connection's own strand
+    template <typename Fn>
+    void onStrand(Fn fn) {
+        if (runtime) {
+            boost::asio::post(runtime->strand(), std::move(fn));
+        } else {
+            fn();
+        }
+    }
+
+    AsyncRuntime* runtime;
+    Client client;
+    Client::connection_ptr connection;
+    MessagePool<TlsDeflateClientConfig> messagePool;
+    DeflateStats deflateStats{"ws.tx"};
+    std::atomic<bool> connected{false};
+    std::atomic<bool> connectionFailed{false};
+    std::unique_ptr<CompletionSlot> connectSlot;
+    std::unique_ptr<CompletionSlot> closeSlot;
+    std::string deviceId;
+    std::ofstream logFile;
+    std::string logFilePath;
+    std::unique_ptr<TTSClient> ttsClient;
+    StageHandler stageHandler;
+    uint64_t messageSeq = 0;
+    std::atomic<uint64_t> utteranceCounter{0};
+    TtsPostprocessor synthPost{TtsPostprocessor::Config::fromEnv()};      // Scheduler thread
+    TtsPostprocessor sentencePost{TtsPostprocessor::Config::fromEnv()};   // Websocket thread
+    std::map<std::string, Reply> replies;       // By sessionId ("" for null)
+    uint64_t replyCounter = 0;
+    // Declared last: its thread uses the TTS client and the stage handler
+    std::unique_ptr<UtteranceScheduler> scheduler;
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "json_util.hpp"
+#include "metrics.hpp"
+
+// Typed view of the ASR server's transcript messages.
+//
+// Partial and final results are parsed as they arrive and published to a
+// callback, called on the websocket thread. A partial whose leading words
+// have stopped changing is additionally reported as StablePartial, so
+// downstream logic can start preparing a response before the final arrives.
+//
+// Accepted shapes: {"type":"partial"|"final"|"transcript", "text" or
+// "transcript", "is_final"/"final", optional "utterance_id"/"segment_id",
+// "confidence", "channel"}.
+
+struct TranscriptEvent {
+    using Clock = std::chrono::steady_clock;
+
+    enum class Kind { Partial, StablePartial, Final };
+
+    Kind kind = Kind::Partial;
+    std::string utteranceId;
+    std::string text;                   // StablePartial: only the stable words
+    double confidence = 0.0;
+    int channel = -1;
+    int revision = 0;                   // Partials seen so far in this utterance
+
+    // Latency stamps
+    Clock::time_point audioStart;       // First audio sent for this utterance
+    Clock::time_point lastAudio;        // Most recent audio sent before this result
+    Clock::time_point received;
+
+    double sinceAudioStartMs() const { return ms(audioStart, received); }
+    double sinceLastAudioMs() const { return ms(lastAudio, received); }
+
+    const char* kindName() const {
+        switch (kind) {
+            case Kind::Partial: return "partial";
+            case Kind::StablePartial: return "stable_partial";
+            case Kind::Final: return "final";
+        }
+        return "";
+    }
+
+    std::string toJson() const {
+        std::ostringstream ss;
+        ss << "{\"type\":\"" << kindName() << "\",\"utterance_id\":\"" << json::escape(utteranceId)
+           << "\",\"text\":\"" << json::escape(text) << "\",\"revision\":" << revision
+           << ",\"channel\":" << channel << ",\"confidence\":" << confidence
+           << ",\"since_audio_start_ms\":" << sinceAudioStartMs()
+           << ",\"since_last_audio_ms\":" << sinceLastAudioMs() << "}";
+        return ss.str();
+    }
+
+private:
+    static double ms(Clock::time_point from, Clock::time_point to) {
+        if (from == Clock::time_point()) return 0.0;
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+};
+
+class TranscriptPipeline {
+public:
+    using Clock = TranscriptEvent::Clock;
+    using Callback = std::function<void(const TranscriptEvent&)>;
+
+    struct Config {
+        size_t stableMinWords = 3;              // Shortest prefix worth acting on
+        int stableRepeats = 2;                  // Partials the prefix must survive
+        std::chrono::milliseconds stableTime{300};  // ...and for at least this long
+    };
+
+    TranscriptPipeline() = default;
+    explicit TranscriptPipeline(const Config& cfg) : config(cfg) {}
+
+    void setCallback(Callback cb) {
+        std::lock_guard<std::mutex> lock(mutex);
+        callback = std::move(cb);
+    }
+
+    // Called for every audio chunk sent; opens an utterance if none is open
+    void noteAudioSent(Clock::time_point when = Clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (utterance.audioStart == Clock::time_point()) utterance.audioStart = when;
+        lastAudio = when;
+    }
+
+    // Returns true if the message was a transcript
+    bool handleMessage(const std::string& message) {
+        const std::string type = json::getString(message, "type");
+        const bool isTranscriptType = type == "partial" || type == "final" || type == "transcript" ||
+                                      type == "partial_transcript" || type == "final_transcript";
+        if (!isTranscriptType) return false;
+
+        std::string text;
+        if (!json::getString(message, "text", text) && !json::getString(message, "transcript", text)) {
+            return false;
+        }
+        const bool isFinal = type == "final" || type == "final_transcript" ||
+                             json::getNumber(message, "is_final", 0.0) != 0.0 ||
+                             json::getNumber(message, "final", 0.0) != 0.0;
+
+        std::string id;
+        if (!json::getString(message, "utterance_id", id)) json::getString(message, "segment_id", id);
+
+        std::vector<TranscriptEvent> events;
+        Callback cb;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto now = Clock::now();
+
+            // A new id from the server starts a new utterance even without a final
+            if (!id.empty() && !utterance.id.empty() && id != utterance.id) {
+                resetUtterance();
+            }
+            if (utterance.id.empty()) {
+                utterance.id = id.empty() ? "u" + std::to_string(++utteranceCounter) : id;
+            }
+
+            TranscriptEvent ev;
+            ev.kind = isFinal ? TranscriptEvent::Kind::Final : TranscriptEvent::Kind::Partial;
+            ev.utteranceId = utterance.id;
+            ev.text = text;
+            ev.confidence = json::getNumber(message, "confidence", 0.0);
+            ev.channel = static_cast<int>(json::getNumber(message, "channel", -1));
+            ev.revision = isFinal ? utterance.revision : ++utterance.revision;
+            ev.audioStart = utterance.audioStart;
+            ev.lastAudio = lastAudio;
+            ev.received = now;
+            events.push_back(ev);
+
+            Metrics& m = Metrics::instance();
+            if (isFinal) {
+                m.add("asr.finals");
+                m.set("asr.final_latency_ms", ev.sinceLastAudioMs());
+                if (utterance.stableAt != Clock::time_point()) {
+                    m.set("asr.stable_lead_ms",
+                          std::chrono::duration<double, std::milli>(now - utterance.stableAt).count());
+                }
+                resetUtterance();
+            } else {
+                m.add("asr.partials");
+                if (utterance.revision == 1) m.set("asr.first_partial_ms", ev.sinceAudioStartMs());
+                if (updateStability(text, now)) {
+                    TranscriptEvent stable = ev;
+                    stable.kind = TranscriptEvent::Kind::StablePartial;
+                    stable.text = utterance.emittedStable;
+                    events.push_back(stable);
+                    m.add("asr.stable_partials");
+                }
+            }
+
+            cb = callback;
+        }
+
+        if (cb) {
+            for (const TranscriptEvent& e : events) cb(e);
+        }
+        return true;
+    }
+
+private:
+    struct Candidate {
+        std::string word;
+        Clock::time_point since;
+        int repeats;
+    };
+
+    struct Utterance {
+        std::string id;
+        int revision = 0;
+        Clock::time_point audioStart;
+        std::vector<Candidate> candidates;  // Leading words of the latest partial
+        size_t emittedWords = 0;
+        std::string emittedStable;
+        Clock::time_point stableAt;
+    };
+
+    static std::vector<std::string> splitWords(const std::string& text) {
+        std::vector<std::string> words;
+        std::istringstream ss(text);
+        std::string w;
+        while (ss >> w) words.push_back(w);
+        return words;
+    }
+
+    // Tracks the words that consecutive partials agree on. The last word of a
+    // partial is still being decoded and never counts. A word is stable once
+    // it has survived stableRepeats partials and stableTime; returns true when
+    // the stable prefix grows past what was last reported.
+    bool updateStability(const std::string& text, Clock::time_point now) {
+        std::vector<std::string> words = splitWords(text);
+        if (!words.empty()) words.pop_back();
+
+        std::vector<Candidate>& cand = utterance.candidates;
+        size_t common = 0;
+        while (common < words.size() && common < cand.size() && words[common] == cand[common].word) {
+            cand[common].repeats++;
+            ++common;
+        }
+        // Revised words restart their clock
+        cand.resize(common);
+        for (size_t i = common; i < words.size(); ++i) {
+            cand.push_back({words[i], now, 1});
+        }
+
+        size_t stableWords = 0;
+        while (stableWords < cand.size() && cand[stableWords].repeats >= config.stableRepeats &&
+               now - cand[stableWords].since >= config.stableTime) {
+            ++stableWords;
+        }
+        if (stableWords < config.stableMinWords || stableWords <= utterance.emittedWords) return false;
+
+        std::string stable;
+        for (size_t i = 0; i < stableWords; ++i) {
+            if (i) stable += ' ';
+            stable += cand[i].word;
+        }
+        utterance.emittedWords = stableWords;
+        utterance.emittedStable = stable;
+        if (utterance.stableAt == Clock::time_point()) utterance.stableAt = now;
+        return true;
+    }
+
+    void resetUtterance() {
+        utterance = Utterance();
+    }
+
+    Config config;
+    std::mutex mutex;
+    Callback callback;
+    Utterance utterance;
+    Clock::time_point lastAudio;
+    uint64_t utteranceCounter = 0;
+};
@@ -7,8 +7,12 @@
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <cstdio>
 #include <cstring>
 
+#include "echo_reference.hpp"
+#include "wav_file.hpp"
+
 using namespace std::chrono_literals;
 
 // Helper function to get environment variables
@@ -17,21 +21,10 @@ static std::string getEnv(const char* key, const std::string& def = "") {
     return v ? std::string(v) : def;
 }
 
-// Callback function to write received data to a vector
+// Callback function to stream received data straight into the output file
 static size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t realsize = size * nmemb;
-    auto* vec = static_cast<std::vector<char>*>(userp);
-    
-    // Get the current position
-    size_t currentSize = vec->size();
-    
-    // Resize the vector to accommodate new data
-    vec->resize(currentSize + realsize);
-    
-    // Copy the new data
-    std::memcpy(vec->data() + currentSize, contents, realsize);
-    
-    return realsize;
+    auto* file = static_cast<std::FILE*>(userp);
+    return std::fwrite(contents, size, nmemb, file) * size;
 }
 
 class TTSClient {
@@ -78,17 +71,23 @@ public:
             std::string url = getEnv("TTS_URL", "https://robot-asr.pvi.digital/api/tts/stream");
             curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
             
-            // Buffer for response
-            std::vector<char> responseBuffer;
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBuffer);
+            // Stream the response body to the output file as it arrives
+            std::FILE* outFile = std::fopen(outputFile.c_str(), "wb");
+            if (!outFile) {
+                std::cerr << "❌ Failed to open output file: " << outputFile << std::endl;
+                return false;
+            }
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, outFile);
             
             // Perform request
             std::cout << "🎤 Requesting TTS for text: " << text << std::endl;
             CURLcode res = curl_easy_perform(curl);
+            std::fclose(outFile);
             
             if (res != CURLE_OK) {
                 std::cerr << "❌ Failed to perform request: " 
                           << curl_easy_strerror(res) << std::endl;
+                std::filesystem::remove(outputFile);
                 return false;
             }
             
@@ -98,19 +97,19 @@ public:
             
             if (httpCode != 200) {
                 std::cerr << "❌ Server returned HTTP code " << httpCode << std::endl;
+                std::filesystem::remove(outputFile);
                 return false;
             }
             
-            // Save response to file
-            std::ofstream outFile(outputFile, std::ios::binary);
-            if (!outFile) {
-                std::cerr << "❌ Failed to open output file: " << outputFile << std::endl;
+            // Reject error pages and empty bodies before they reach the player
+            try {
+                WavReader check(outputFile);
+            } catch (const std::exception& e) {
+                std::cerr << "❌ Invalid audio from TTS server: " << e.what() << std::endl;
+                std::filesystem::remove(outputFile);
                 return false;
             }
             
-            outFile.write(responseBuffer.data(), responseBuffer.size());
-            outFile.close();
-            
             std::cout << "✅ Audio saved to: " << outputFile << std::endl;
             return true;
             
@@ -126,6 +125,9 @@ public:
             std::string playCmd = "aplay -D plughw:6,0 '" + audioFile + "'";
             std::cout << "🎵 Playing audio: " << playCmd << std::endl;
             
+            // Let audio_uploader use this playback as its echo reference
+            echo_ref::publishReference(getEnv("AEC_REF_DIR", "/tmp/aec_ref"), audioFile);
+            
             int result = system(playCmd.c_str());
             if (result != 0) {
                 std::cerr << "❌ Failed to play audio, aplay returned: " 
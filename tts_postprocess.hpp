@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "audio_dsp.hpp"
+#include "metrics.hpp"
+#include "wav_file.hpp"
+
+// Clean-up applied to TTS audio before speak plays it.
+//
+// Synthesized WAVs start and end with padding silence that delays the first
+// word and leaves gaps between sentences. Each clip is trimmed to its speech
+// (keeping a short margin), normalized to a common loudness measured over
+// the blocks above the silence gate, and limited to a peak ceiling. Runs of
+// sentence_audio clips are joined with a short crossfade: the tail of each
+// sentence is held back and blended into the start of the next one of the
+// same reply. Each reply keeps its own tail, so interleaved replies never
+// blend into each other, and a tail is only thrown away when its reply is
+// cancelled; a reply that ends without a last sentence gets it back from
+// flush().
+class TtsPostprocessor {
+public:
+    struct Config {
+        bool enabled = true;
+        float trimDb = -45.0f;                      // Peak level below which audio counts as silence
+        std::chrono::milliseconds keep{40};         // Margin left before and after the speech
+        bool normalize = true;
+        float targetDb = -20.0f;                    // RMS of the speech blocks, dBFS
+        float maxGainDb = 12.0f;
+        float ceilingDb = -1.0f;                    // Peak limit after gain, dBFS
+        std::chrono::milliseconds crossfade{15};
+
+        static Config fromEnv() {
+            Config c;
+            auto env = [](const char* key) -> std::string {
+                const char* v = std::getenv(key);
+                return v ? v : "";
+            };
+            if (env("TTS_POSTPROCESS") == "0") c.enabled = false;
+            if (!env("TTS_TRIM_DB").empty()) c.trimDb = std::stof(env("TTS_TRIM_DB"));
+            if (!env("TTS_TRIM_KEEP_MS").empty()) c.keep = std::chrono::milliseconds(std::stoi(env("TTS_TRIM_KEEP_MS")));
+            const std::string target = env("TTS_TARGET_DBFS");
+            if (target == "off") {
+                c.normalize = false;
+            } else if (!target.empty()) {
+                c.targetDb = std::stof(target);
+            }
+            if (!env("TTS_MAX_GAIN_DB").empty()) c.maxGainDb = std::stof(env("TTS_MAX_GAIN_DB"));
+            if (!env("TTS_CROSSFADE_MS").empty()) {
+                c.crossfade = std::chrono::milliseconds(std::stoi(env("TTS_CROSSFADE_MS")));
+            }
+            return c;
+        }
+    };
+
+    TtsPostprocessor() = default;
+    explicit TtsPostprocessor(const Config& cfg) : config(cfg) {}
+
+    const Config& getConfig() const { return config; }
+
+    // Trims and normalizes a WAV file in place. Files that are not PCM16, or
+    // not readable WAVs at all, are left alone; returns false only if the
+    // file could not be rewritten.
+    bool processFile(const std::string& path) {
+        if (!config.enabled) return true;
+        WavFormat fmt;
+        try {
+            WavReader reader(path);
+            if (!prepare(reader.view())) return true;
+            fmt = reader.format();
+        } catch (const std::exception&) {
+            return true;
+        }
+        try {
+            toPcm(work.data(), work.size());
+            WavWriter writer(path, fmt);
+            writer.writeSamples(pcm.data(), pcm.size());
+            writer.close();
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // One clip of a sentence run of `reply`, returned as a WAV image in
+    // `out`. `first` starts a new run: a tail still held from the previous
+    // run is played at its head rather than blended. `last` flushes the tail
+    // instead of holding it. False if the clip is not a WAV image.
+    bool processSentence(const std::string& reply, const char* wav, size_t size, bool first, bool last,
+                         std::vector<char>& out) {
+        WavView view;
+        if (!view.parse(wav, size)) return false;
+        if (!config.enabled || !prepare(view)) {
+            out.assign(wav, wav + size);
+            return true;
+        }
+        const WavFormat& fmt = view.format();
+        const size_t channels = fmt.channels;
+
+        auto held = carries.find(reply);
+        if (held != carries.end()) {
+            const std::vector<float>& carry = held->second.samples;
+            const bool sameFormat = fmt.channels == held->second.fmt.channels &&
+                                    fmt.sampleRate == held->second.fmt.sampleRate;
+            if (!first && sameFormat && carry.size() <= work.size()) {
+                dsp::crossfade(carry.data(), work.data(), work.data(), carry.size());
+            } else if (sameFormat) {
+                // New run, or a clip shorter than the fade: play the held tail before it
+                work.insert(work.begin(), carry.begin(), carry.end());
+            }
+            carries.erase(held);
+        }
+
+        if (!last) {
+            const size_t fadeFrames = static_cast<size_t>(fmt.sampleRate * config.crossfade.count() / 1000);
+            const size_t tail = std::min(fadeFrames * channels, work.size() / channels * channels);
+            Carry& carry = carries[reply];
+            carry.samples.assign(work.end() - static_cast<std::ptrdiff_t>(tail), work.end());
+            carry.fmt = fmt;
+            carry.heldSince = std::chrono::steady_clock::now();
+            work.resize(work.size() - tail);
+        }
+
+        toPcm(work.data(), work.size());
+        buildWavImage(fmt, pcm.data(), pcm.size() * sizeof(int16_t), out);
+        return true;
+    }
+
+    // The tail held for `reply` as a WAV image of its own, for a reply that
+    // ended without its last sentence. False if nothing is held.
+    bool flush(const std::string& reply, std::vector<char>& out) {
+        auto held = carries.find(reply);
+        if (held == carries.end()) return false;
+        toPcm(held->second.samples.data(), held->second.samples.size());
+        buildWavImage(held->second.fmt, pcm.data(), pcm.size() * sizeof(int16_t), out);
+        carries.erase(held);
+        return true;
+    }
+
+    // Flushes the tail of some reply other than `except` that has waited
+    // longer than `age` for its next sentence; call until it returns false
+    bool flushStale(std::chrono::milliseconds age, const std::string& except, std::vector<char>& out) {
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& [reply, carry] : carries) {
+            if (reply != except && now - carry.heldSince > age) {
+                return flush(std::string(reply), out);
+            }
+        }
+        return false;
+    }
+
+    // Replies stopped before they finished: their tails are never played
+    void cancelAll() {
+        carries.clear();
+    }
+
+private:
+    // Trimmed, gain-adjusted float samples of `view` into `work`; false if
+    // the clip is not PCM16
+    bool prepare(const WavView& view) {
+        const WavFormat& fmt = view.format();
+        const int16_t* x = view.samples();
+        if (!x || !fmt.isPcm16() || fmt.channels == 0 || fmt.sampleRate == 0) return false;
+        const auto start = std::chrono::steady_clock::now();
+
+        const size_t channels = fmt.channels;
+        const size_t frames = view.sampleCount() / channels;
+        const int16_t threshold = static_cast<int16_t>(std::clamp(
+            32768.0f * std::pow(10.0f, config.trimDb / 20.0f), 0.0f, 32767.0f));
+
+        // Speech bounds, widened by the margin and kept on frame boundaries
+        const size_t n = frames * channels;
+        size_t first = dsp::firstAbove(x, n, threshold) / channels;
+        size_t last = (dsp::lastAbove(x, n, threshold) + channels - 1) / channels;
+        if (first >= last) {
+            first = last = 0;
+        } else {
+            const size_t keep = static_cast<size_t>(fmt.sampleRate * config.keep.count() / 1000);
+            first = first > keep ? first - keep : 0;
+            last = std::min(frames, last + keep);
+        }
+
+        const size_t count = (last - first) * channels;
+        work.resize(count);
+        dsp::int16ToFloat(x + first * channels, work.data(), count);
+
+        Metrics& m = Metrics::instance();
+        m.add("tts.trimmed_ms", static_cast<double>(frames - (last - first)) * 1000.0 / fmt.sampleRate);
+        if (config.normalize && count > 0) {
+            const float gain = loudnessGain(x + first * channels, count, fmt, threshold / 32768.0f);
+            dsp::scale(work.data(), gain, count);
+            m.set("tts.gain_db", 20.0 * std::log10(gain));
+        }
+        m.set("tts.post_ms", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        return true;
+    }
+
+    // Gain that brings the gated RMS of `work` to the target without
+    // exceeding maxGainDb or pushing the peak of `x` over the ceiling
+    float loudnessGain(const int16_t* x, size_t count, const WavFormat& fmt, float gate) const {
+        const size_t block = std::max<size_t>(1, fmt.sampleRate / 50) * fmt.channels;   // 20 ms
+        double energy = 0.0;
+        size_t voiced = 0;
+        for (size_t i = 0; i + block <= count; i += block) {
+            const float e = dsp::dotProduct(work.data() + i, work.data() + i, block);
+            if (std::sqrt(e / block) > gate) {
+                energy += e;
+                voiced += block;
+            }
+        }
+        if (voiced == 0) return 1.0f;
+
+        const float rms = static_cast<float>(std::sqrt(energy / voiced));
+        float gain = std::pow(10.0f, config.targetDb / 20.0f) / std::max(rms, 1e-6f);
+        gain = std::min(gain, std::pow(10.0f, config.maxGainDb / 20.0f));
+
+        const float peak = static_cast<float>(dsp::peakAbs(x, count)) / 32768.0f;
+        if (peak > 0.0f) gain = std::min(gain, std::pow(10.0f, config.ceilingDb / 20.0f) / peak);
+        return gain;
+    }
+
+    void toPcm(const float* samples, size_t n) {
+        pcm.resize(n);
+        dsp::floatToInt16(samples, pcm.data(), n);
+    }
+
+    // Held-back tail of a reply's previous sentence
+    struct Carry {
+        std::vector<float> samples;
+        WavFormat fmt;
+        std::chrono::steady_clock::time_point heldSince;
+    };
+
+    Config config;
+    std::vector<float> work;        // Current clip
+    std::map<std::string, Carry> carries;   // By reply
+    std::vector<int16_t> pcm;
+};
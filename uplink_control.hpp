@@ -0,0 +1,245 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+#include "audio_dsp.hpp"
+#include "metrics.hpp"
+
+// Uplink quality for audio_uploader, adapted to what the link carries.
+//
+// Two measurements drive it: the round trip of WebSocket pings, and the
+// drain rate of the connection's send buffer (bytes handed to the socket
+// since the last sample, minus what is still buffered). Only intervals in
+// which the buffer never ran dry measure the link itself; the others just
+// show how much was offered. The delay of the next chunk is estimated as
+// what is buffered over the drain rate, plus half the round trip.
+//
+// When that goes above the target the controller steps one mode down the
+// ladder: first silent chunks are no longer sent, then audio goes at half
+// the capture rate, then the voice detector gets stricter. It steps back up
+// after the delay has stayed below half the target for a while, and waits
+// twice as long after a step up that had to be undone.
+class UplinkController {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Mode {
+        const char* name;
+        unsigned rateDivisor;   // 1 sends the capture rate, 2 half of it
+        float vadDb;            // Chunks with no 20 ms block above this stay home; 0 sends everything
+    };
+
+    // Best first; uplink.mode reports the index
+    static constexpr size_t modeCount = 4;
+    static const std::array<Mode, modeCount>& ladder() {
+        static const std::array<Mode, modeCount> modes = {{
+            {"full", 1, 0.0f},
+            {"vad", 1, -55.0f},
+            {"half_rate_vad", 2, -55.0f},
+            {"half_rate_strict_vad", 2, -45.0f},
+        }};
+        return modes;
+    }
+
+    struct Config {
+        bool adapt = true;                              // Off: measure only, always send full quality
+        std::chrono::milliseconds target{500};          // Delay to keep the next chunk under
+        std::chrono::milliseconds sampleInterval{100};  // Send buffer sampling
+        std::chrono::milliseconds pingInterval{1000};
+        std::chrono::milliseconds hold{2000};           // After a change, before the next step down
+        std::chrono::milliseconds recoverAfter{10000};  // Calm needed before a step up
+
+        static Config fromEnv() {
+            auto ms = [](const char* key, std::chrono::milliseconds def) {
+                const char* v = std::getenv(key);
+                return v ? std::chrono::milliseconds(std::atoi(v)) : def;
+            };
+            Config c;
+            const char* adapt = std::getenv("UPLINK_ADAPT");
+            c.adapt = !adapt || std::string(adapt) != "0";
+            c.target = ms("UPLINK_TARGET_MS", c.target);
+            c.sampleInterval = ms("UPLINK_SAMPLE_MS", c.sampleInterval);
+            c.pingInterval = ms("UPLINK_PING_MS", c.pingInterval);
+            c.hold = ms("UPLINK_HOLD_MS", c.hold);
+            c.recoverAfter = ms("UPLINK_RECOVER_MS", c.recoverAfter);
+            return c;
+        }
+    };
+
+    UplinkController() : UplinkController(Config()) {}
+    explicit UplinkController(const Config& cfg) : config(cfg), recoverHold(cfg.recoverAfter) {
+        Metrics::instance().set("uplink.mode", 0);
+    }
+
+    const Config& getConfig() const {
+        return config;
+    }
+
+    // Mode for the next chunk
+    const Mode& mode() const {
+        return ladder()[level.load()];
+    }
+
+    size_t getLevel() const {
+        return level.load();
+    }
+
+    // A new connection: the path may have changed, so measurements start
+    // over. The mode stays until the new link proves better or worse.
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        haveSample = false;
+        drainRate = 0.0;
+        rtt = 0.0;
+        calmSince = Clock::time_point();
+    }
+
+    void onRtt(double rttMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rtt = rtt > 0.0 ? rtt * 0.75 + rttMs * 0.25 : rttMs;
+        Metrics::instance().set("uplink.rtt_ms", rtt);
+    }
+
+    // `buffered` is what the connection has not written yet, `queuedTotal`
+    // the bytes ever handed to it. Returns true when the mode changed.
+    bool sample(size_t buffered, uint64_t queuedTotal, Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!haveSample) {
+            haveSample = true;
+            prevBuffered = buffered;
+            prevQueued = queuedTotal;
+            prevAt = now;
+            return false;
+        }
+
+        const double dt = std::chrono::duration<double>(now - prevAt).count();
+        if (dt <= 0.0) return false;
+        const uint64_t offered = prevBuffered + (queuedTotal - prevQueued);
+        const double drained = offered > buffered ? static_cast<double>(offered - buffered) : 0.0;
+        const double rate = drained / dt;
+        if (prevBuffered > 0 && buffered > 0) {
+            // Busy the whole interval: this is what the link carries
+            drainRate = drainRate > 0.0 ? drainRate * 0.7 + rate * 0.3 : rate;
+        } else if (rate > drainRate) {
+            // The buffer ran dry, so the link carries at least this much
+            drainRate = rate;
+        }
+        prevBuffered = buffered;
+        prevQueued = queuedTotal;
+        prevAt = now;
+
+        const double queueMs = buffered == 0 ? 0.0
+                             : drainRate > 0.0 ? static_cast<double>(buffered) * 1000.0 / drainRate
+                             : dt * 1000.0;
+        delay = queueMs + rtt / 2.0;
+
+        Metrics& m = Metrics::instance();
+        m.set("uplink.queue_ms", queueMs);
+        m.set("uplink.drain_kbps", drainRate * 8.0 / 1000.0);
+        return config.adapt && adapt(now);
+    }
+
+    // Estimated delay of the next chunk, as of the last sample
+    double delayMs() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return delay;
+    }
+
+    double rttMs() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rtt;
+    }
+
+    double drainKbps() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return drainRate * 8.0 / 1000.0;
+    }
+
+    // Voice activity gate for one mono chunk sent in mode `m`. Returns false
+    // when the chunk can stay home; the chunk after a voiced one is always
+    // sent so trailing words are not clipped. Called from the chunk path
+    // only.
+    bool admit(const Mode& m, const float* x, size_t n, uint32_t sampleRate) {
+        if (m.vadDb >= 0.0f || voiced(x, n, sampleRate, m.vadDb)) {
+            hangover = 1;
+            return true;
+        }
+        if (hangover > 0) {
+            --hangover;
+            return true;
+        }
+        Metrics::instance().add("uplink.vad_skipped");
+        return false;
+    }
+
+private:
+    static bool voiced(const float* x, size_t n, uint32_t sampleRate, float thresholdDb) {
+        const size_t block = std::max<size_t>(1, sampleRate / 50);   // 20 ms
+        const float threshold = std::pow(10.0f, thresholdDb / 20.0f);
+        const float energy = threshold * threshold * static_cast<float>(block);
+        for (size_t i = 0; i + block <= n; i += block) {
+            if (dsp::dotProduct(x + i, x + i, block) > energy) return true;
+        }
+        return false;
+    }
+
+    // Called with the lock held
+    bool adapt(Clock::time_point now) {
+        const size_t current = level.load();
+        const double target = static_cast<double>(config.target.count());
+
+        if (delay > target) {
+            calmSince = Clock::time_point();
+            if (current + 1 >= modeCount || now - lastChange < config.hold) return false;
+            // Undoing a step up that did not hold: be slower to try again
+            if (probing) recoverHold = std::min(recoverHold * 2, config.recoverAfter * 8);
+            probing = false;
+            change(current + 1, now);
+            return true;
+        }
+
+        if (delay > target / 2.0) {
+            calmSince = Clock::time_point();
+            return false;
+        }
+        if (calmSince == Clock::time_point()) calmSince = now;
+        if (now - calmSince < recoverHold) return false;
+        calmSince = Clock::time_point();
+        if (probing) recoverHold = config.recoverAfter;     // The last step up held
+        probing = current > 0;
+        if (current == 0) return false;
+        change(current - 1, now);
+        return true;
+    }
+
+    void change(size_t next, Clock::time_point now) {
+        level = next;
+        lastChange = now;
+        Metrics& m = Metrics::instance();
+        m.set("uplink.mode", static_cast<double>(next));
+        m.add("uplink.mode_changes");
+    }
+
+    Config config;
+    std::atomic<size_t> level{0};
+    mutable std::mutex mutex;
+    bool haveSample = false;
+    size_t prevBuffered = 0;
+    uint64_t prevQueued = 0;
+    Clock::time_point prevAt;
+    double drainRate = 0.0;         // Bytes per second
+    double rtt = 0.0;               // Smoothed, ms
+    double delay = 0.0;
+    Clock::time_point lastChange;
+    Clock::time_point calmSince;
+    std::chrono::milliseconds recoverHold;
+    bool probing = false;           // At a level reached by stepping up, not yet calm there
+    int hangover = 0;
+};
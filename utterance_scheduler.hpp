@@ -0,0 +1,462 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Orders pending TTS utterances for speak.
+//
+// Utterances carry a priority class and a time budget. The worker thread
+// always takes the highest class first, earliest deadline within a class.
+// An utterance that has used half of its budget before synthesis is cut to
+// its first sentence; one past its deadline is dropped, since stale
+// directions are worse than none. A newer utterance with the same supersede
+// key replaces a pending one and cuts off a playing one (the newest
+// navigation wins), and a submission of a strictly higher class interrupts
+// what is playing; that one goes back in the queue unless it was already
+// being heard. Audio that arrives already synthesized (sentence_audio) is
+// queued the same way with submitAudio(). Clips of one reply are scheduled
+// as a unit: they share the deadline of the reply's first clip, count once
+// against maxPending, are shed together, and once the reply has started
+// playing none of its clips is shed or expired, so a reply is never cut
+// short in the middle.
+class UtteranceScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Priority { Safety = 0, Conversation = 1, Idle = 2 };
+
+    struct Config {
+        // Time budget per class, indexed by Priority
+        std::chrono::milliseconds budget[3] = {
+            std::chrono::milliseconds(5000),
+            std::chrono::milliseconds(15000),
+            std::chrono::milliseconds(30000),
+        };
+        size_t maxPending = 16;     // Lowest-priority pending item (or reply) goes beyond this
+    };
+
+    // How utterances are turned into sound. play() blocks until playback ends
+    // and returns false if it was interrupted or failed; stop() interrupts it
+    // from another thread. play() gets the class so alerts can be mixed
+    // differently from conversation. A stop() can land before play() has
+    // anything to stop, so play() must ask `interrupted` once its player is
+    // registered and stop at once if that returns true.
+    using InterruptCheck = std::function<bool()>;
+    struct Backend {
+        std::function<bool(const std::string& text, std::string& audioFile)> synthesize;
+        std::function<bool(const std::string& audioFile, Priority priority, const InterruptCheck& interrupted)> play;
+        std::function<void()> stop;
+        std::function<void(const std::string& audioFile)> discard;
+    };
+
+    // Stage notifications with the caller's tag: "queued", "synthesized",
+    // "playback_start", "playback_end", "dropped", "preempted"
+    using StageHandler = std::function<void(const char* stage, uint64_t tag)>;
+
+    UtteranceScheduler(const Config& cfg, Backend backend, StageHandler stageHandler = nullptr)
+        : config(cfg), backend(std::move(backend)), stageHandler(std::move(stageHandler)) {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~UtteranceScheduler() {
+        std::vector<Utterance> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            dropped.swap(pending);
+        }
+        cv.notify_all();
+        if (backend.stop) backend.stop();
+        if (thread.joinable()) thread.join();
+        for (const Utterance& u : dropped) discard(u);
+    }
+
+    UtteranceScheduler(const UtteranceScheduler&) = delete;
+    UtteranceScheduler& operator=(const UtteranceScheduler&) = delete;
+
+    static const char* priorityName(Priority p) {
+        switch (p) {
+            case Priority::Safety: return "safety";
+            case Priority::Conversation: return "conversation";
+            case Priority::Idle: return "idle";
+        }
+        return "";
+    }
+
+    void submit(Priority priority, const std::string& text, const std::string& supersedeKey, uint64_t tag) {
+        Utterance u;
+        u.text = text;
+        enqueue(std::move(u), priority, supersedeKey, tag);
+    }
+
+    // Queues an audio file that is already synthesized; the scheduler owns it
+    // from here and hands it to backend.discard when done. Clips with the
+    // same non-empty `reply` are sentences of one reply.
+    void submitAudio(Priority priority, const std::string& audioFile, const std::string& supersedeKey, uint64_t tag,
+                     const std::string& reply = "") {
+        Utterance u;
+        u.audioFile = audioFile;
+        u.reply = reply;
+        enqueue(std::move(u), priority, supersedeKey, tag);
+    }
+
+    // Drops everything pending and stops playback (audio_stop from the server)
+    void stopAll() {
+        std::vector<Utterance> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            dropped.swap(pending);
+            for (auto& entry : replies) entry.second.shed = true;
+            if (active) interrupt = Interrupt::Cancel;
+            if (!active) idleCv.notify_all();
+        }
+        for (const Utterance& u : dropped) drop(u);
+        if (backend.stop) backend.stop();
+    }
+
+    // Blocks until nothing is pending or playing
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idleCv.wait(lock, [this]() { return pending.empty() && !active; });
+    }
+
+    size_t pendingCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending.size();
+    }
+
+private:
+    // Why the active utterance is being stopped
+    enum class Interrupt { None, Preempt, Supersede, Cancel };
+
+    struct Utterance {
+        uint64_t seq = 0;
+        Priority priority = Priority::Conversation;
+        std::string text;
+        std::string audioFile;      // Set once synthesized (or when submitted as audio)
+        std::string supersedeKey;
+        std::string reply;          // Sentence clip of this reply, or empty
+        uint64_t tag = 0;
+        Clock::time_point deadline;
+        Clock::time_point shortenAfter;
+    };
+
+    // Scheduling state shared by the clips of one reply
+    struct Reply {
+        Clock::time_point deadline;     // From the reply's first clip
+        Clock::time_point shortenAfter;
+        Clock::time_point lastSeen;
+        bool started = false;           // A clip has been taken for playback
+        bool shed = false;              // Dropped as a whole; later clips follow
+    };
+
+    void enqueue(Utterance u, Priority priority, const std::string& supersedeKey, uint64_t tag) {
+        const auto now = Clock::now();
+        const auto budget = config.budget[static_cast<int>(priority)];
+        u.priority = priority;
+        u.supersedeKey = supersedeKey;
+        u.tag = tag;
+        u.deadline = now + budget;
+        u.shortenAfter = now + budget / 2;
+
+        // Reported before the worker can see it, so stages stay in order
+        stage("queued", tag);
+
+        std::vector<Utterance> dropped;
+        bool preempt = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            u.seq = ++lastSeq;
+            if (!u.reply.empty() && !joinReply(u, now)) {
+                // The rest of this reply was shed; its later sentences go too
+                Metrics::instance().add("speak.shed");
+                dropped.push_back(std::move(u));
+            } else {
+                if (!supersedeKey.empty()) {
+                    auto it = std::stable_partition(pending.begin(), pending.end(), [&](const Utterance& p) {
+                        return p.supersedeKey != supersedeKey;
+                    });
+                    std::move(it, pending.end(), std::back_inserter(dropped));
+                    pending.erase(it, pending.end());
+                    Metrics::instance().add("speak.superseded", static_cast<double>(dropped.size()));
+                }
+
+                pending.push_back(std::move(u));
+                shedExcess(dropped);
+
+                if (active && !supersedeKey.empty() && supersedeKey == activeKey && interrupt != Interrupt::Cancel) {
+                    // Stale however urgent it is: not put back
+                    interrupt = Interrupt::Supersede;
+                    Metrics::instance().add("speak.superseded");
+                    preempt = true;
+                } else if (active && interrupt == Interrupt::None &&
+                           static_cast<int>(priority) < static_cast<int>(activePriority)) {
+                    interrupt = Interrupt::Preempt;
+                    Metrics::instance().add("speak.preemptions");
+                    preempt = true;
+                }
+            }
+        }
+        cv.notify_all();
+
+        for (const Utterance& d : dropped) drop(d);
+        if (preempt && backend.stop) backend.stop();
+    }
+
+    // The rest are called with the lock held
+
+    // True for a clip of a reply that has started playing: it is neither shed
+    // nor expired
+    bool committed(const Utterance& u) const {
+        if (u.reply.empty()) return false;
+        auto it = replies.find(u.reply);
+        return it != replies.end() && it->second.started;
+    }
+
+    // Pending items as maxPending counts them: a reply counts once
+    size_t pendingUnits() const {
+        std::vector<const std::string*> seen;
+        size_t units = 0;
+        for (const Utterance& p : pending) {
+            if (!p.reply.empty()) {
+                auto same = [&](const std::string* r) { return *r == p.reply; };
+                if (std::find_if(seen.begin(), seen.end(), same) != seen.end()) continue;
+                seen.push_back(&p.reply);
+            }
+            ++units;
+        }
+        return units;
+    }
+
+    // Sheds the least urgent items beyond maxPending; a reply goes as a
+    // whole, and one that is already playing is never picked
+    void shedExcess(std::vector<Utterance>& dropped) {
+        while (pendingUnits() > config.maxPending) {
+            auto worst = pending.end();
+            for (auto it = pending.begin(); it != pending.end(); ++it) {
+                if (committed(*it)) continue;
+                if (worst == pending.end() || earlier(*worst, *it)) worst = it;
+            }
+            if (worst == pending.end()) return;
+
+            const std::string reply = worst->reply;
+            if (reply.empty()) {
+                dropped.push_back(std::move(*worst));
+                pending.erase(worst);
+            } else {
+                replies[reply].shed = true;
+                auto it = std::stable_partition(pending.begin(), pending.end(), [&](const Utterance& p) {
+                    return p.reply != reply;
+                });
+                std::move(it, pending.end(), std::back_inserter(dropped));
+                pending.erase(it, pending.end());
+            }
+            Metrics::instance().add("speak.shed");
+        }
+    }
+
+    // Gives a reply's clip the reply's deadline, starting the reply if this
+    // is its first clip. False if the reply has been shed.
+    bool joinReply(Utterance& u, Clock::time_point now) {
+        pruneReplies(now);
+        auto [it, fresh] = replies.try_emplace(u.reply);
+        if (fresh) {
+            it->second.deadline = u.deadline;
+            it->second.shortenAfter = u.shortenAfter;
+        }
+        it->second.lastSeen = now;
+        u.deadline = it->second.deadline;
+        u.shortenAfter = it->second.shortenAfter;
+        return !it->second.shed;
+    }
+
+    // Forgets replies that have had no clip for a minute and none pending
+    void pruneReplies(Clock::time_point now) {
+        for (auto it = replies.begin(); it != replies.end();) {
+            const bool referenced = std::any_of(pending.begin(), pending.end(), [&](const Utterance& p) {
+                return p.reply == it->first;
+            });
+            if (!referenced && now - it->second.lastSeen > std::chrono::minutes(1)) {
+                it = replies.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // For backend.play: true once the active utterance should stop
+    bool interrupted() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stopping || interrupt != Interrupt::None;
+    }
+
+    void discard(const Utterance& u) {
+        if (!u.audioFile.empty() && backend.discard) backend.discard(u.audioFile);
+    }
+
+    void drop(const Utterance& u) {
+        discard(u);
+        stage("dropped", u.tag);
+    }
+
+    // Ordering: class, then deadline, then arrival
+    static bool earlier(const Utterance& a, const Utterance& b) {
+        if (a.priority != b.priority) return a.priority < b.priority;
+        if (a.deadline != b.deadline) return a.deadline < b.deadline;
+        return a.seq < b.seq;
+    }
+
+    // Text up to and including the first sentence terminator
+    static std::string firstSentence(const std::string& text) {
+        const size_t end = text.find_first_of(".!?");
+        return end == std::string::npos || end + 1 >= text.size() ? text : text.substr(0, end + 1);
+    }
+
+    void stage(const char* name, uint64_t tag) {
+        if (stageHandler) stageHandler(name, tag);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (stopping) break;
+
+            // Expire stale items, then take the most urgent one
+            const auto now = Clock::now();
+            auto it = std::stable_partition(pending.begin(), pending.end(), [&](const Utterance& u) {
+                return u.deadline >= now || committed(u);
+            });
+            std::vector<Utterance> expired(std::make_move_iterator(it), std::make_move_iterator(pending.end()));
+            pending.erase(it, pending.end());
+            if (!expired.empty()) {
+                Metrics::instance().add("speak.expired", static_cast<double>(expired.size()));
+                lock.unlock();
+                for (const Utterance& u : expired) drop(u);
+                lock.lock();
+                if (pending.empty() && !active) idleCv.notify_all();
+                continue;
+            }
+
+            auto best = std::min_element(pending.begin(), pending.end(), earlier);
+            Utterance u = std::move(*best);
+            pending.erase(best);
+            active = true;
+            activePriority = u.priority;
+            activeKey = u.supersedeKey;
+            if (!u.reply.empty()) replies[u.reply].started = true;
+            interrupt = Interrupt::None;
+            lock.unlock();
+
+            speak(u);
+
+            lock.lock();
+            active = false;
+            if (pending.empty()) idleCv.notify_all();
+        }
+        active = false;
+        idleCv.notify_all();
+    }
+
+    void speak(Utterance& u) {
+        Metrics& m = Metrics::instance();
+        m.set("speak.queue_ms", std::chrono::duration<double, std::milli>(
+            Clock::now() - (u.deadline - config.budget[static_cast<int>(u.priority)])).count());
+
+        std::string audioFile = u.audioFile;
+        if (audioFile.empty()) {
+            std::string text = u.text;
+            if (Clock::now() > u.shortenAfter) {
+                const std::string shortened = firstSentence(text);
+                if (shortened.size() < text.size()) {
+                    text = shortened;
+                    m.add("speak.shortened");
+                }
+            }
+            if (!backend.synthesize(text, audioFile)) {
+                stage("dropped", u.tag);
+                return;
+            }
+        }
+        stage("synthesized", u.tag);
+
+        // Synthesis takes a while; the world may have moved on
+        Interrupt before;
+        bool mustPlay;
+        std::vector<Utterance> shed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            before = interrupt;
+            mustPlay = committed(u);
+            if (before == Interrupt::Preempt) {
+                // Not heard yet: put it back, audio and all, behind whatever
+                // preempted it, within the same limit as any submission
+                u.audioFile = audioFile;
+                pending.push_back(u);
+                shedExcess(shed);
+            }
+        }
+        if (before == Interrupt::Preempt) {
+            for (const Utterance& d : shed) drop(d);
+            return;
+        }
+        if (before != Interrupt::None || (!mustPlay && Clock::now() > u.deadline)) {
+            if (before == Interrupt::None) m.add("speak.expired");
+            stage("dropped", u.tag);
+            if (backend.discard) backend.discard(audioFile);
+            return;
+        }
+
+        stage("playback_start", u.tag);
+        const bool completed = backend.play(audioFile, u.priority, [this]() { return interrupted(); });
+
+        Interrupt after;
+        bool replay = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            after = interrupt;
+            // A sentence of a reply cut off by something more urgent is said
+            // again afterwards rather than skipped
+            replay = !completed && after == Interrupt::Preempt && !u.reply.empty();
+            if (replay) {
+                u.audioFile = audioFile;
+                pending.push_back(u);
+            }
+        }
+        if (!replay && backend.discard) backend.discard(audioFile);
+        if (!completed && after != Interrupt::None) {
+            m.add("speak.interrupted");
+            stage("preempted", u.tag);
+        } else {
+            m.add(std::string("speak.played.") + priorityName(u.priority));
+            stage("playback_end", u.tag);
+        }
+    }
+
+    Config config;
+    Backend backend;
+    StageHandler stageHandler;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable idleCv;
+    std::vector<Utterance> pending;
+    uint64_t lastSeq = 0;
+    bool active = false;
+    Priority activePriority = Priority::Idle;
+    std::string activeKey;
+    std::map<std::string, Reply> replies;
+    Interrupt interrupt = Interrupt::None;
+    bool stopping = false;
+    std::thread thread;
+};
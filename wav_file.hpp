@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// RIFF/WAVE helpers shared by the uploader, speak, the server recorder and
+// the test fixtures.
+//
+// WavView parses a WAV image that already lives in memory, WavReader maps a
+// file and exposes its samples without copying, WavWriter streams PCM to
+// disk and patches the header sizes when it is closed.
+
+struct WavFormat {
+    uint16_t audioFormat = 1;   // 1 = PCM (WAVE_FORMAT_EXTENSIBLE is folded into its subformat)
+    uint16_t channels = 1;
+    uint32_t sampleRate = 16000;
+    uint16_t bitsPerSample = 16;
+
+    uint16_t blockAlign() const { return static_cast<uint16_t>(channels * bitsPerSample / 8); }
+    uint32_t byteRate() const { return sampleRate * blockAlign(); }
+    bool isPcm16() const { return audioFormat == 1 && bitsPerSample == 16; }
+};
+
+class WavView {
+public:
+    // Chunk size of a stream whose length was not known when the header was written
+    static constexpr uint32_t kOpenSize = 0xFFFFFFFFu;
+
+    // Walks the chunk list. Tolerates what we see in practice: LIST/INFO
+    // chunks before or after fmt, odd-sized chunks with their pad byte, the
+    // 0xFFFFFFFF data size written by streaming encoders and data chunks
+    // that claim more than the file holds (both read to the end of the
+    // file). A data size of 0 is an empty clip. Returns false with a reason
+    // otherwise.
+    bool parse(const char* bytes, size_t size, std::string* error = nullptr) {
+        base = bytes;
+        total = size;
+        pcm = nullptr;
+        pcmSize = 0;
+
+        if (size == 0) return fail(error, "empty file");
+        if (size < 12 || std::memcmp(bytes, "RIFF", 4) != 0 || std::memcmp(bytes + 8, "WAVE", 4) != 0) {
+            return fail(error, "not a RIFF/WAVE file");
+        }
+
+        bool haveFmt = false;
+        size_t off = 12;
+        while (off + 8 <= size) {
+            const uint32_t chunkSize = readU32(off + 4);
+            const size_t body = off + 8;
+
+            if (std::memcmp(bytes + off, "fmt ", 4) == 0) {
+                if (chunkSize < 16 || body + 16 > size) return fail(error, "truncated fmt chunk");
+                fmt.audioFormat = readU16(body);
+                fmt.channels = readU16(body + 2);
+                fmt.sampleRate = readU32(body + 4);
+                fmt.bitsPerSample = readU16(body + 14);
+                if (fmt.audioFormat == 0xFFFE && chunkSize >= 40 && body + 26 <= size) {
+                    // WAVE_FORMAT_EXTENSIBLE: the real format is the first
+                    // two bytes of the subformat GUID
+                    fmt.audioFormat = readU16(body + 24);
+                }
+                haveFmt = true;
+            } else if (std::memcmp(bytes + off, "data", 4) == 0) {
+                pcm = bytes + body;
+                const size_t avail = size - body;
+                pcmSize = (chunkSize == kOpenSize || chunkSize > avail) ? avail : chunkSize;
+                // Streaming writers leave the size open; nothing after it is meaningful
+                if (chunkSize == kOpenSize) break;
+            }
+
+            if (chunkSize > size - body) break;
+            off = body + chunkSize + (chunkSize & 1);
+        }
+
+        if (!haveFmt) return fail(error, "missing fmt chunk");
+        if (!pcm) return fail(error, "missing data chunk");
+        if (fmt.blockAlign() == 0) return fail(error, "invalid fmt chunk");
+        // Drop a trailing partial frame
+        pcmSize -= pcmSize % fmt.blockAlign();
+        return true;
+    }
+
+    const WavFormat& format() const { return fmt; }
+
+    // Whole file image (header included), e.g. for forwarding verbatim
+    const char* bytes() const { return base; }
+    size_t size() const { return total; }
+
+    const char* pcmData() const { return pcm; }
+    size_t pcmBytes() const { return pcmSize; }
+    size_t pcmOffset() const { return pcm ? static_cast<size_t>(pcm - base) : 0; }
+
+    size_t frameCount() const { return fmt.blockAlign() ? pcmSize / fmt.blockAlign() : 0; }
+    double durationSeconds() const { return fmt.sampleRate ? double(frameCount()) / fmt.sampleRate : 0.0; }
+
+    // Interleaved PCM16 samples, or nullptr for any other encoding. Chunks
+    // are word aligned so the pointer is suitably aligned for int16_t.
+    const int16_t* samples() const {
+        return fmt.isPcm16() ? reinterpret_cast<const int16_t*>(pcm) : nullptr;
+    }
+    size_t sampleCount() const { return fmt.isPcm16() ? pcmSize / sizeof(int16_t) : 0; }
+
+private:
+    bool fail(std::string* error, const char* reason) {
+        if (error) *error = reason;
+        return false;
+    }
+    uint16_t readU16(size_t off) const { uint16_t v; std::memcpy(&v, base + off, 2); return v; }
+    uint32_t readU32(size_t off) const { uint32_t v; std::memcpy(&v, base + off, 4); return v; }
+
+    const char* base = nullptr;
+    size_t total = 0;
+    const char* pcm = nullptr;
+    size_t pcmSize = 0;
+    WavFormat fmt;
+};
+
+// Memory-mapped WAV file. The mapping is private and writable, so in-place
+// processing (echo cancellation, gain) touches copy-on-write pages and never
+// modifies the file on disk.
+class WavReader {
+public:
+    explicit WavReader(const std::string& path) : filename(path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+
+        struct stat st{};
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file: " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length == 0) {
+            ::close(fd);
+            throw std::runtime_error("Empty WAV file: " + path);
+        }
+
+        void* addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Failed to map file: " + path);
+        }
+        mapping = static_cast<char*>(addr);
+        ::madvise(mapping, length, MADV_SEQUENTIAL);
+
+        std::string error;
+        if (!wav.parse(mapping, length, &error)) {
+            unmap();
+            throw std::runtime_error("Invalid WAV file " + path + ": " + error);
+        }
+    }
+
+    WavReader(const WavReader&) = delete;
+    WavReader& operator=(const WavReader&) = delete;
+
+    WavReader(WavReader&& other) noexcept
+        : filename(std::move(other.filename)), mapping(other.mapping), length(other.length), wav(other.wav) {
+        other.mapping = nullptr;
+        other.length = 0;
+    }
+
+    ~WavReader() { unmap(); }
+
+    const WavView& view() const { return wav; }
+    const WavFormat& format() const { return wav.format(); }
+    const std::string& path() const { return filename; }
+
+    const char* bytes() const { return mapping; }
+    size_t size() const { return length; }
+
+    const int16_t* samples() const { return wav.samples(); }
+    size_t sampleCount() const { return wav.sampleCount(); }
+
+    // Writable alias of samples() backed by private pages
+    int16_t* mutableSamples() {
+        return wav.samples() ? reinterpret_cast<int16_t*>(mapping + wav.pcmOffset()) : nullptr;
+    }
+
+private:
+    void unmap() {
+        if (mapping) {
+            ::munmap(mapping, length);
+            mapping = nullptr;
+        }
+    }
+
+    std::string filename;
+    char* mapping = nullptr;
+    size_t length = 0;
+    WavView wav;
+};
+
+// Streaming WAV writer. The header is written up front with open
+// (0xFFFFFFFF) sizes and patched on close(), so a crashed writer still
+// leaves a file WavView reads to the end.
+class WavWriter {
+public:
+    WavWriter(const std::string& path, const WavFormat& format) : filename(path), fmt(format) {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("Failed to open output file: " + path);
+        }
+        writeHeader(WavView::kOpenSize);
+    }
+
+    WavWriter(const WavWriter&) = delete;
+    WavWriter& operator=(const WavWriter&) = delete;
+
+    ~WavWriter() {
+        try {
+            close();
+        } catch (...) {
+            // Destructor must not throw
+        }
+    }
+
+    void write(const void* data, size_t bytes) {
+        if (!file) throw std::runtime_error("WAV writer is closed: " + filename);
+        if (bytes && std::fwrite(data, 1, bytes, file) != bytes) {
+            throw std::runtime_error("Failed to write file: " + filename);
+        }
+        dataBytes += bytes;
+    }
+
+    void writeSamples(const int16_t* samples, size_t count) {
+        write(samples, count * sizeof(int16_t));
+    }
+
+    void close() {
+        if (!file) return;
+        // The handle is released whatever happens; the first failure wins
+        std::string error;
+        if ((dataBytes & 1) && std::fputc(0, file) == EOF) { // RIFF pad byte
+            error = "Failed to write WAV pad byte: " + filename;
+        } else if (std::fseek(file, 0, SEEK_SET) != 0) {
+            error = "Failed to seek to WAV header: " + filename;
+        } else {
+            try {
+                writeHeader(static_cast<uint32_t>(dataBytes));
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        const bool closed = std::fclose(file) == 0;
+        file = nullptr;
+        if (error.empty() && !closed) error = "Failed to finalize file: " + filename;
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+
+    size_t bytesWritten() const { return dataBytes; }
+
+    // Canonical 44-byte header for a PCM payload of dataSize bytes
+    static void buildHeader(const WavFormat& fmt, uint32_t dataSize, char out[44]) {
+        auto putU16 = [&](size_t off, uint16_t v) { std::memcpy(out + off, &v, 2); };
+        auto putU32 = [&](size_t off, uint32_t v) { std::memcpy(out + off, &v, 4); };
+        std::memcpy(out, "RIFF", 4);
+        putU32(4, dataSize == WavView::kOpenSize ? WavView::kOpenSize : 36 + dataSize + (dataSize & 1));
+        std::memcpy(out + 8, "WAVEfmt ", 8);
+        putU32(16, 16);
+        putU16(20, fmt.audioFormat);
+        putU16(22, fmt.channels);
+        putU32(24, fmt.sampleRate);
+        putU32(28, fmt.byteRate());
+        putU16(32, fmt.blockAlign());
+        putU16(34, fmt.bitsPerSample);
+        std::memcpy(out + 36, "data", 4);
+        putU32(40, dataSize);
+    }
+
+private:
+    void writeHeader(uint32_t dataSize) {
+        char header[44];
+        buildHeader(fmt, dataSize, header);
+        if (std::fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+            throw std::runtime_error("Failed to write WAV header: " + filename);
+        }
+    }
+
+    std::string filename;
+    WavFormat fmt;
+    std::FILE* file = nullptr;
+    size_t dataBytes = 0;
+};
+
+// Builds a complete in-memory WAV image (canonical header + PCM) into out,
+// reusing its capacity
+inline void buildWavImage(const WavFormat& fmt, const void* pcm, size_t bytes, std::vector<char>& out) {
+    out.resize(44 + bytes);
+    WavWriter::buildHeader(fmt, static_cast<uint32_t>(bytes), out.data());
+    if (bytes) std::memcpy(out.data() + 44, pcm, bytes);
+}
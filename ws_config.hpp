@@ -0,0 +1,183 @@
+#pragma once
+
+#include <websocketpp/config/asio_client.hpp>
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "metrics.hpp"
+
+// WebSocket client configuration shared by audio_uploader and speak:
+// asio_tls_client plus a tunable permessage-deflate (RFC 7692) extension,
+// and the per-message policy deciding which frames are worth compressing.
+
+// Extension tunables, read once from the environment before connecting.
+//   WS_DEFLATE=0                         do not offer the extension at all
+//   WS_DEFLATE_CLIENT_WINDOW_BITS=9..15  our compression window (default 15)
+//   WS_DEFLATE_SERVER_WINDOW_BITS=9..15  window requested from the server
+//   WS_DEFLATE_NO_CONTEXT_TAKEOVER=1     reset our compressor per message
+//   WS_DEFLATE_AUDIO=1                   also compress audio payloads
+//   WS_DEFLATE_MIN_BYTES=256             skip messages smaller than this
+//   WS_DEFLATE_STATS_EVERY=50            estimate the ratio every Nth message
+struct DeflateSettings {
+    bool enabled = true;
+    uint8_t clientWindowBits = 15;
+    uint8_t serverWindowBits = 15;
+    bool clientNoContextTakeover = false;
+    bool compressAudio = false;
+    size_t minBytes = 256;
+    size_t statsEvery = 50;
+
+    static DeflateSettings& current() {
+        static DeflateSettings settings = fromEnv();
+        return settings;
+    }
+
+    static DeflateSettings fromEnv() {
+        auto env = [](const char* key, const char* def) {
+            const char* v = std::getenv(key);
+            return std::string(v ? v : def);
+        };
+        // zlib cannot produce raw deflate streams with an 8-bit window
+        auto bits = [](const std::string& v) {
+            int b = std::stoi(v);
+            return static_cast<uint8_t>(b < 9 ? 9 : (b > 15 ? 15 : b));
+        };
+
+        DeflateSettings s;
+        s.enabled = env("WS_DEFLATE", "1") == "1";
+        s.clientWindowBits = bits(env("WS_DEFLATE_CLIENT_WINDOW_BITS", "15"));
+        s.serverWindowBits = bits(env("WS_DEFLATE_SERVER_WINDOW_BITS", "15"));
+        s.clientNoContextTakeover = env("WS_DEFLATE_NO_CONTEXT_TAKEOVER", "0") == "1";
+        s.compressAudio = env("WS_DEFLATE_AUDIO", "0") == "1";
+        s.minBytes = std::stoul(env("WS_DEFLATE_MIN_BYTES", "256"));
+        s.statsEvery = std::stoul(env("WS_DEFLATE_STATS_EVERY", "50"));
+        return s;
+    }
+
+    // Control and text traffic compresses well; audio is dense PCM (or a
+    // compressed codec) and is left alone unless explicitly enabled
+    bool shouldCompress(bool isAudio, size_t size) const {
+        if (!enabled || size < minBytes) return false;
+        return isAudio ? compressAudio : true;
+    }
+};
+
+// permessage-deflate with the settings above applied at construction and an
+// offer that advertises them. websocketpp instantiates one per connection.
+template <typename ExtConfig>
+class TunedDeflate : public websocketpp::extensions::permessage_deflate::enabled<ExtConfig> {
+public:
+    TunedDeflate() {
+        namespace pmd = websocketpp::extensions::permessage_deflate;
+        const DeflateSettings& s = DeflateSettings::current();
+        this->set_client_max_window_bits(s.clientWindowBits, pmd::mode::smallest);
+        if (s.clientNoContextTakeover) {
+            this->enable_client_no_context_takeover();
+        }
+    }
+
+    // Hides the base offer; the processor calls this on the concrete type
+    std::string generate_offer() const {
+        const DeflateSettings& s = DeflateSettings::current();
+        if (!s.enabled) return "";
+
+        std::string offer = "permessage-deflate; client_max_window_bits";
+        if (s.clientWindowBits < 15) {
+            offer += "=" + std::to_string(s.clientWindowBits);
+        }
+        if (s.serverWindowBits < 15) {
+            offer += "; server_max_window_bits=" + std::to_string(s.serverWindowBits);
+        }
+        if (s.clientNoContextTakeover) {
+            offer += "; client_no_context_takeover";
+        }
+        return offer;
+    }
+};
+
+struct TlsDeflateClientConfig : public websocketpp::config::asio_tls_client {
+    typedef TlsDeflateClientConfig type;
+    typedef websocketpp::config::asio_tls_client base;
+
+    typedef base::concurrency_type concurrency_type;
+    typedef base::request_type request_type;
+    typedef base::response_type response_type;
+    typedef base::message_type message_type;
+    // Frames are built in recycled messages (buffer_pool.hpp)
+    typedef PooledMessageManager<message_type> con_msg_manager_type;
+    typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<con_msg_manager_type>
+        endpoint_msg_manager_type;
+    typedef base::alog_type alog_type;
+    typedef base::elog_type elog_type;
+    typedef base::rng_type rng_type;
+
+    struct transport_config : public base::transport_config {
+        typedef type::concurrency_type concurrency_type;
+        typedef type::alog_type alog_type;
+        typedef type::elog_type elog_type;
+        typedef type::request_type request_type;
+        typedef type::response_type response_type;
+        typedef websocketpp::transport::asio::tls_socket::endpoint socket_type;
+    };
+    typedef websocketpp::transport::asio::endpoint<transport_config> transport_type;
+
+    struct permessage_deflate_config {};
+    typedef TunedDeflate<permessage_deflate_config> permessage_deflate_type;
+};
+
+// Compression accounting. websocketpp compresses inside send() on the calling
+// thread, so timing the call gives the CPU cost per byte. The wire size is
+// not exposed, so every Nth compressed message is also deflated locally with
+// the same window to estimate the ratio.
+class DeflateStats {
+public:
+    explicit DeflateStats(std::string prefix) : prefix(std::move(prefix)) {}
+
+    using Clock = std::chrono::steady_clock;
+
+    void record(const std::string& payload, bool compressed, Clock::duration sendTime) {
+        Metrics& m = Metrics::instance();
+        const double us = std::chrono::duration<double, std::micro>(sendTime).count();
+        const std::string kind = compressed ? ".deflate" : ".plain";
+        m.add(prefix + kind + ".messages");
+        m.add(prefix + kind + ".bytes", static_cast<double>(payload.size()));
+        m.add(prefix + kind + ".send_us", us);
+
+        const DeflateSettings& s = DeflateSettings::current();
+        if (compressed && s.statsEvery && sampleCounter++ % s.statsEvery == 0) {
+            const size_t estimated = estimateCompressedSize(payload, s.clientWindowBits);
+            if (estimated) {
+                m.set(prefix + ".deflate.ratio", static_cast<double>(payload.size()) / estimated);
+            }
+        }
+    }
+
+private:
+    static size_t estimateCompressedSize(const std::string& payload, uint8_t windowBits) {
+        z_stream zs{};
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        std::vector<unsigned char> out(deflateBound(&zs, payload.size()));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(payload.data()));
+        zs.avail_in = static_cast<uInt>(payload.size());
+        zs.next_out = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+        deflate(&zs, Z_SYNC_FLUSH);
+        const size_t size = out.size() - zs.avail_out;
+        deflateEnd(&zs);
+        // RFC 7692 strips the trailing 00 00 ff ff of the sync flush
+        return size > 4 ? size - 4 : size;
+    }
+
+    std::string prefix;
+    size_t sampleCounter = 0;
+};